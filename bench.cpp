@@ -0,0 +1,1025 @@
+// bench.cpp
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "engine.h"
+#include "impair.h"
+#include "transfer.h"
+
+// 性能测试工具，所有测试都在本机回环地址上进行，服务端和客户端运行在不同线程中。
+// 使用 ./bench <test> [args] 的形式运行，不带参数时打印可用的测试。
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief  握手速率测试
+ *  多个客户端线程不断建立新连接，同时可选地由洪泛线程向服务端持续发送 SYN
+ * 且从不回复 ACK，模拟 SYN 洪泛攻击，统计服务端每秒完成的握手数。
+ *  服务端 rudp_accept 返回才算完成一次握手，客户端收到 SYN-ACK 但 ACK 丢失的
+ * 连接不计入。
+ * @param total  总握手次数
+ * @param clients  客户端线程数
+ * @param flood_rate  每秒洪泛的 SYN 数，0 表示不洪泛
+ * @return double  返回服务端每秒接受的连接数
+ */
+static double runHandshake(int total, int clients, int flood_rate) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return 0;
+    }
+
+    std::atomic<bool> done{false};
+    std::atomic<bool> server_done{false};
+    std::atomic<long> flood_sent{0};
+    std::atomic<long> accepted{0};
+
+    // 客户端的 ACK 可能丢失，所以服务端不按次数退出，而是一直接受到测试结束
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        while (!done.load()) {
+            if (rudp_accept(server_fd, client_addr) == 0) {
+                accepted.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        server_done = true;
+    });
+
+    std::thread flooder;
+    if (flood_rate > 0) {
+        flooder = std::thread([&] {
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            Packet syn;
+            syn.type = SYN;
+            // 每 1ms 发送一批，保持给定的洪泛速率
+            const int batch = flood_rate / 1000 > 0 ? flood_rate / 1000 : 1;
+            auto next = Clock::now();
+            while (!done.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < batch; ++i) {
+                    sendPacket(fd, syn, server_addr);
+                }
+                flood_sent.fetch_add(batch, std::memory_order_relaxed);
+                next += std::chrono::milliseconds(1);
+                std::this_thread::sleep_until(next);
+            }
+            close(fd);
+        });
+    }
+
+    auto start = Clock::now();
+    std::vector<std::thread> workers;
+    for (int c = 0; c < clients; ++c) {
+        workers.emplace_back([&, c] {
+            for (int i = c; i < total; i += clients) {
+                int fd = socket(AF_INET, SOCK_DGRAM, 0);
+                sockaddr_in addr = server_addr;
+                rudp_connect(fd, addr);
+                close(fd);
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    // 之后用来让服务端退出的握手不计入
+    long accepted_in_time = accepted.load();
+
+    // 服务端可能已经因为最后一个 ACK 退出，所以这里不能用会一直重试的
+    // rudp_connect，而是手动握手，直到服务端线程退出
+    done = true;
+    int kick_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    while (!server_done.load()) {
+        Packet pkt;
+        pkt.type = SYN;
+        sendPacket(kick_fd, pkt, server_addr);
+        sockaddr_in from{};
+        if (recvPacket(kick_fd, pkt, from) > 0 && pkt.type == SYN_ACK) {
+            pkt.type = ACK;
+            sendPacket(kick_fd, pkt, server_addr);
+        }
+    }
+    close(kick_fd);
+    server.join();
+    if (flooder.joinable()) {
+        flooder.join();
+    }
+    close(server_fd);
+
+    double rate = accepted_in_time / elapsed;
+    printf("handshake flood=%d/s total=%d clients=%d time=%.3fs accepted=%ld "
+           "accept_rate=%.0f/s connect_rate=%.0f/s",
+           flood_rate, total, clients, elapsed, accepted_in_time, rate,
+           total / elapsed);
+    if (flood_rate > 0) {
+        printf(" flood_syn=%ld", flood_sent.load());
+    }
+    printf("\n");
+    return rate;
+}
+
+static int benchHandshake(int argc, char* argv[]) {
+    int total = argc > 0 ? atoi(argv[0]) : 2000;
+    int clients = argc > 1 ? atoi(argv[1]) : 4;
+    int flood_rate = argc > 2 ? atoi(argv[2]) : 20000;
+    double base = runHandshake(total, clients, 0);
+    double flooded = runHandshake(total, clients, flood_rate);
+    printf("accept throughput under flood: %.1f%% of baseline\n",
+           base > 0 ? flooded * 100 / base : 0);
+    return 0;
+}
+
+/**
+ * @brief  打印延迟分布
+ * @param name  测试名称
+ * @param samples  每次请求的耗时（微秒）
+ */
+static void printLatency(const char* name, std::vector<double>& samples) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (double v : samples) {
+        sum += v;
+    }
+    auto pct = [&](double p) {
+        return samples[static_cast<size_t>(p * (samples.size() - 1))];
+    };
+    printf("%-16s n=%zu mean=%.1fus p50=%.1fus p99=%.1fus p999=%.1fus\n", name,
+           samples.size(), sum / samples.size(), pct(0.5), pct(0.99),
+           pct(0.999));
+}
+
+/**
+ * @brief  短连接请求/响应测试
+ *  模拟 client-hello/server-hello 的使用方式：每次请求都新建连接，发送一条消息，
+ * 收到回复后关闭连接。fast 为 true 时客户端保存令牌，后续请求用 0-RTT 发送。
+ * @param count  请求次数
+ * @param fast  是否使用 0-RTT
+ */
+static void runRpc(int count, bool fast) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+
+    std::thread server([&] {
+        char buffer[DATA_SIZE];
+        for (int i = 0; i < count; ++i) {
+            sockaddr_in client_addr{};
+            ssize_t n =
+                rudp_accept_data(server_fd, client_addr, buffer, DATA_SIZE);
+            uint32_t expected_seq = 0;
+            if (n == 0) {
+                n = rudp_receive_data(server_fd, buffer, DATA_SIZE,
+                                      client_addr, expected_seq);
+            }
+            uint32_t seq_num = 0;
+            rudp_send_data(server_fd, buffer, n, client_addr, seq_num,
+                           deliveryDuplex(expected_seq));
+            rudp_wait_close(server_fd, client_addr);
+        }
+    });
+
+    const char message[] = "Hello from Client";
+    char buffer[DATA_SIZE];
+    ResumeToken token;
+    std::vector<double> samples;
+    for (int i = 0; i < count; ++i) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr = server_addr;
+        auto start = Clock::now();
+        ssize_t sent = 0;
+        if (fast) {
+            sent = rudp_connect_data(fd, addr, message, sizeof(message), token);
+        } else {
+            rudp_connect(fd, addr);
+        }
+        if (sent == 0) {
+            uint32_t seq_num = 0;
+            rudp_send_data(fd, message, sizeof(message), addr, seq_num);
+        }
+        uint32_t expected_seq = 0;
+        rudp_receive_data(fd, buffer, DATA_SIZE, addr, expected_seq);
+        samples.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start)
+                .count());
+        rudp_close_connection(fd, addr);
+        close(fd);
+    }
+    server.join();
+    close(server_fd);
+    printLatency(fast ? "rpc 0-rtt" : "rpc 1-rtt", samples);
+}
+
+static int benchRpc(int argc, char* argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 2000;
+    runRpc(count, false);
+    runRpc(count, true);
+    return 0;
+}
+
+/**
+ * @brief  发送节奏控制测试
+ *  模拟窗口式发送：每个 RTT 放出一个窗口的数据包，接收方的 socket 缓冲区
+ * 设置得比较小。不开启 pacing 时整个窗口连续发出，开启后均匀分散在一个 RTT
+ * 内，统计两种方式下的丢包率。
+ * @param rounds  发送的窗口数
+ * @param window  每个窗口的数据包数
+ * @param rtt_us  模拟的 RTT（微秒）
+ * @param mode  0 不限速，1 用户态令牌桶，2 SO_TXTIME
+ */
+static void runPacing(int rounds, int window, int rtt_us, int mode) {
+    sockaddr_in recv_addr{};
+    int recv_fd = bindLoopback(recv_addr);
+    if (recv_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    int rcvbuf = 64 * 1024;
+    setsockopt(recv_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    std::atomic<bool> done{false};
+    long received = 0;
+    std::thread receiver([&] {
+        Packet pkt;
+        sockaddr_in from{};
+        while (true) {
+            ssize_t n = recvPacket(recv_fd, pkt, from);
+            if (n > 0) {
+                ++received;
+            } else if (n == 0 && done.load()) {
+                break;
+            }
+        }
+    });
+
+    int send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    Pacer pacer;
+    if (mode > 0) {
+        pacerInit(send_fd, pacer, mode == 2);
+        pacerSetRate(pacer, static_cast<double>(window) * sizeof(Packet),
+                     rtt_us / 1e6);
+    }
+
+    Packet pkt;
+    pkt.type = DATA;
+    pkt.data_length = DATA_SIZE;
+    auto start = Clock::now();
+    auto next_round = start;
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < window; ++i) {
+            pkt.seq = r * window + i;
+            sendPacketPaced(send_fd, pkt, recv_addr, pacer);
+        }
+        next_round += std::chrono::microseconds(rtt_us);
+        std::this_thread::sleep_until(next_round);
+    }
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    done = true;
+    receiver.join();
+    close(send_fd);
+    close(recv_fd);
+
+    static const char* names[] = {"burst", "token-bucket", "SO_TXTIME"};
+    long sent = static_cast<long>(rounds) * window;
+    printf("pacing %-12s sent=%ld received=%ld loss=%.2f%% time=%.3fs\n",
+           names[mode], sent, received, 100.0 * (sent - received) / sent,
+           elapsed);
+}
+
+static int benchPacing(int argc, char* argv[]) {
+    int rounds = argc > 0 ? atoi(argv[0]) : 200;
+    int window = argc > 1 ? atoi(argv[1]) : 128;
+    int rtt_us = argc > 2 ? atoi(argv[2]) : 4000;
+    bool txtime = argc > 3 && std::string(argv[3]) == "txtime";
+    runPacing(rounds, window, rtt_us, 0);
+    runPacing(rounds, window, rtt_us, 1);
+    if (txtime) {
+        runPacing(rounds, window, rtt_us, 2);
+    }
+    return 0;
+}
+
+/**
+ * @brief  乒乓延迟测试
+ *  与 client-hello/server-hello 相同的收发方式，但在一条连接上反复交换小消息，
+ * 统计每次往返的延迟分布。busy_poll 为 true 时两端都开启低延迟模式，
+ * 有多个核时服务端和客户端分别绑定到 0 号和 1 号 CPU。
+ * @param count  往返次数
+ * @param busy_poll  是否开启低延迟模式
+ */
+static void runPingPong(int count, bool busy_poll) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    bool pin = std::thread::hardware_concurrency() > 1;
+
+    std::thread server([&] {
+        if (busy_poll) {
+            rudp_enable_low_latency(server_fd, pin ? 0 : -1);
+        }
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        char buffer[DATA_SIZE];
+        uint32_t expected_seq = 0;
+        uint32_t seq_num = 0;
+        for (int i = 0; i < count; ++i) {
+            ssize_t n = rudp_receive_data(server_fd, buffer, DATA_SIZE,
+                                          client_addr, expected_seq);
+            rudp_send_data(server_fd, buffer, n, client_addr, seq_num,
+                           deliveryDuplex(expected_seq));
+        }
+        rudp_wait_close(server_fd, client_addr);
+        rudp_disable_low_latency(server_fd);
+    });
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (busy_poll) {
+        rudp_enable_low_latency(fd, pin ? 1 : -1);
+    }
+    sockaddr_in addr = server_addr;
+    rudp_connect(fd, addr);
+
+    const char message[] = "Hello from Client";
+    char buffer[DATA_SIZE];
+    uint32_t seq_num = 0;
+    uint32_t expected_seq = 0;
+    std::vector<double> samples;
+    for (int i = 0; i < count; ++i) {
+        auto start = Clock::now();
+        rudp_send_data(fd, message, sizeof(message), addr, seq_num,
+                       deliveryDuplex(expected_seq));
+        rudp_receive_data(fd, buffer, DATA_SIZE, addr, expected_seq);
+        samples.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start)
+                .count());
+    }
+    rudp_close_connection(fd, addr);
+    rudp_disable_low_latency(fd);
+    server.join();
+    close(fd);
+    close(server_fd);
+
+    printLatency(busy_poll ? "pingpong poll" : "pingpong select", samples);
+}
+
+static int benchPingPong(int argc, char* argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 10000;
+    runPingPong(count, false);
+    runPingPong(count, true);
+    return 0;
+}
+
+/**
+ * @brief  用通用函数实现和引擎相同的收发接口，两个方向的序号保存在这里
+ */
+struct GenericEndpoint {
+    int sockfd;
+    sockaddr_in addr;
+    uint32_t seq_num = 0;
+    uint32_t expected_seq = 0;
+
+    GenericEndpoint(int sockfd, const sockaddr_in& addr)
+        : sockfd(sockfd), addr(addr) {}
+
+    ssize_t send(const char* data, size_t length) {
+        DeliveryPolicy policy = deliveryDuplex(expected_seq);
+        policy.rto_ms = 20;
+        return rudp_send_data(sockfd, data, length, addr, seq_num, policy);
+    }
+
+    ssize_t receive(char* buffer, size_t max_length) {
+        return rudp_receive_data(sockfd, buffer, max_length, addr,
+                                 expected_seq);
+    }
+};
+
+/**
+ * @brief  方向切换时丢失 ACK 的回归测试
+ *  客户端和服务端在一条连接上交替收发请求和回复，中继每两个服务端的 DATA_ACK
+ * 丢弃一个。服务端对请求的 ACK 丢失后，客户端一边重传请求一边收到回复，
+ * 只能重新确认重复的数据包，回复必须留给之后的接收调用，不能确认后丢弃。
+ * 客户端的 ACK 不丢，最后一条回复的 ACK 丢失时关闭连接会卡住。
+ * 每条回复都要原样收到，卡住超过 timeout_ms 算失败。
+ *  握手和挥手使用通用函数，数据阶段使用 E：GenericEndpoint 或者引擎。
+ * @param name  实现的名称
+ * @param rounds  请求次数
+ * @param timeout_ms  整个测试的时限（毫秒）
+ * @return bool  返回所有回复是否都正确收到
+ */
+template <typename E>
+static bool runAckLoss(const char* name, int rounds, int timeout_ms) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    LossyRelay relay;
+    int acks = 0;  // 只在中继线程中访问
+    relay.drop = [&](const Packet& pkt, bool from_server) {
+        return from_server && pkt.type == DATA_ACK && ++acks % 2 == 0;
+    };
+    if (server_fd < 0 || startRelay(relay, server_addr, 0) < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return false;
+    }
+
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        E endpoint(server_fd, client_addr);
+        char buffer[DATA_SIZE];
+        for (int i = 0; i < rounds; ++i) {
+            ssize_t n = endpoint.receive(buffer, DATA_SIZE);
+            endpoint.send(buffer, n);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    std::atomic<int> delivered{0};
+    std::atomic<bool> done{false};
+    std::thread client([&] {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in addr = relay.addr;
+        rudp_connect(fd, addr);
+        E endpoint(fd, addr);
+        char buffer[DATA_SIZE];
+        for (int i = 0; i < rounds; ++i) {
+            std::string request = "request " + std::to_string(i);
+            endpoint.send(request.c_str(), request.size() + 1);
+            if (endpoint.receive(buffer, DATA_SIZE) > 0 && request == buffer) {
+                ++delivered;
+            }
+        }
+        rudp_close_connection(fd, addr);
+        close(fd);
+        done = true;
+    });
+
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!done.load() && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    bool ok = done.load() && delivered.load() == rounds;
+    printf("ackloss %-8s rounds=%d delivered=%d %s\n", name, rounds,
+           delivered.load(), ok ? "ok" : "FAILED");
+    if (!done.load()) {
+        // 卡住的线程无法唤醒，它们引用着这里的局部变量，直接退出进程
+        fflush(stdout);
+        _exit(1);
+    }
+    client.join();
+    server.join();
+    stopRelay(relay);
+    close(server_fd);
+    return ok;
+}
+
+static int benchAckLoss(int argc, char* argv[]) {
+    int rounds = argc > 0 ? atoi(argv[0]) : 50;
+    // 每次丢包都有重传警告，这里只输出错误
+    FLAGS_minloglevel = 2;
+    bool ok = runAckLoss<GenericEndpoint>("generic", rounds, 20000) &&
+              runAckLoss<Engine<Fletcher16Integrity, FixedRto<20>, SelectIO,
+                                NoTrace>>("engine", rounds, 20000);
+    FLAGS_minloglevel = 1;
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief  实时数据测试
+ *  发送方按固定间隔产生帧（比如媒体帧），经过丢包中继发给接收方，帧中带有
+ * 产生时刻，接收方统计从产生到交付的延迟。完全可靠时一次丢包会让后面的帧
+ * 排队等待；有期限时过期的帧被放弃，延迟的长尾被限制在期限附近。
+ * 两种模式使用相同的重传超时。
+ * @param count  帧数
+ * @param loss  丢包率
+ * @param deadline_ms  期限（毫秒）
+ * @param interval_us  产生帧的间隔（微秒）
+ * @param partial  是否使用期限
+ */
+static void runDeadline(int count, double loss, int deadline_ms,
+                        int interval_us, bool partial) {
+    const size_t frame_size = 2500;  // 每帧 3 个分片
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    LossyRelay relay;
+    if (server_fd < 0 || startRelay(relay, server_addr, loss) < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+
+    std::vector<double> samples;
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        std::vector<char> frame;
+        uint32_t expected_seq = 0;
+        // 空消息表示结束
+        while (rudp_recv_message(server_fd, frame, client_addr,
+                                 expected_seq) > 0) {
+            uint64_t produced;
+            memcpy(&produced, frame.data(), sizeof(produced));
+            samples.push_back((monotonicNs() - produced) / 1000.0);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = relay.addr;
+    rudp_connect(fd, addr);
+
+    std::vector<char> frame(frame_size, 'x');
+    uint32_t seq_num = 0;
+    int abandoned = 0;
+    DeliveryPolicy policy;
+    policy.rto_ms = std::max(1, deadline_ms / 4);
+    uint64_t start = monotonicNs();
+    for (int i = 0; i < count; ++i) {
+        uint64_t produced = start + static_cast<uint64_t>(i) * interval_us * 1000;
+        uint64_t now = monotonicNs();
+        if (now < produced) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(produced - now));
+        }
+        memcpy(frame.data(), &produced, sizeof(produced));
+        if (partial) {
+            policy.deadline_ns = produced + deadline_ms * 1000000ULL;
+        }
+        if (rudp_send_message(fd, frame, addr, seq_num, policy) < 0) {
+            ++abandoned;
+        }
+    }
+    // 结束标记和挥手不经过丢包，避免测试卡在关闭连接上
+    relay.loss = 0;
+    rudp_send_message(fd, std::span<const char>(), addr, seq_num);
+    rudp_close_connection(fd, addr);
+    server.join();
+    stopRelay(relay);
+    close(fd);
+    close(server_fd);
+
+    printf("deadline %-8s loss=%.1f%% delivered=%zu abandoned=%d\n",
+           partial ? "partial" : "reliable", loss * 100, samples.size(),
+           abandoned);
+    printLatency(partial ? "deadline partial" : "deadline reliable", samples);
+}
+
+static int benchDeadline(int argc, char* argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 2000;
+    double loss = argc > 1 ? atof(argv[1]) / 100 : 0.05;
+    int deadline_ms = argc > 2 ? atoi(argv[2]) : 20;
+    int interval_us = argc > 3 ? atoi(argv[3]) : 2000;
+    // 有损链路上每次重传都有一条警告，这里只输出错误
+    FLAGS_minloglevel = 2;
+    runDeadline(count, loss, deadline_ms, interval_us, false);
+    runDeadline(count, loss, deadline_ms, interval_us, true);
+    FLAGS_minloglevel = 1;
+    return 0;
+}
+
+/**
+ * @brief  打印单向传输的吞吐量
+ */
+static void printThroughput(const char* name, int count, size_t packet_data,
+                            double seconds) {
+    printf("engine %-20s packets=%d data=%zuB %.2f MiB/s %.2fus/packet\n",
+           name, count, packet_data, count * packet_data / seconds / (1 << 20),
+           seconds * 1e6 / count);
+}
+
+/**
+ * @brief  通用实现的单向传输
+ *  rudp_send_data/rudp_receive_data 逐个发送填满的数据包，作为对照。
+ * @param count  数据包个数
+ */
+static void runGeneric(int count) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        char buffer[DATA_SIZE];
+        uint32_t expected_seq = 0;
+        for (int i = 0; i < count; ++i) {
+            rudp_receive_data(server_fd, buffer, DATA_SIZE, client_addr,
+                              expected_seq);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = server_addr;
+    rudp_connect(fd, addr);
+    std::vector<char> data(DATA_SIZE, 'x');
+    uint32_t seq_num = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < count; ++i) {
+        rudp_send_data(fd, data.data(), data.size(), addr, seq_num);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    rudp_close_connection(fd, addr);
+    server.join();
+    close(fd);
+    close(server_fd);
+    printThroughput("generic", count, DATA_SIZE, seconds);
+}
+
+/**
+ * @brief  连接引擎的单向传输
+ *  握手和挥手使用通用函数，数据阶段使用引擎 E，两端是同一种配置。
+ * @param name  配置名称
+ * @param count  数据包个数
+ */
+template <typename E>
+static void runEngine(const char* name, int count) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        E engine(server_fd, client_addr);
+        std::vector<char> buffer(E::kDataSize);
+        for (int i = 0; i < count; ++i) {
+            engine.receive(buffer.data(), buffer.size());
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = server_addr;
+    rudp_connect(fd, addr);
+    E engine(fd, addr);
+    std::vector<char> data(E::kDataSize, 'x');
+    auto start = Clock::now();
+    for (int i = 0; i < count; ++i) {
+        engine.send(data.data(), data.size());
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    rudp_close_connection(fd, addr);
+    server.join();
+    close(fd);
+    close(server_fd);
+    printThroughput(name, count, E::kDataSize, seconds);
+}
+
+static int benchEngine(int argc, char* argv[]) {
+    int count = argc > 0 ? atoi(argv[0]) : 20000;
+    runGeneric(count);
+    runEngine<DefaultEngine>("default", count);
+    runEngine<Engine<Fletcher16Integrity, FixedRto<RTO_MS>, SelectIO, NoTrace>>(
+        "fletcher-notrace", count);
+    runEngine<LoopbackEngine>("loopback", count);
+    runEngine<Engine<NoIntegrity, AdaptiveRto<>, SelectIO, NoTrace, 8192>>(
+        "loopback-8k", count);
+    return 0;
+}
+
+/**
+ * @brief  单向传输的吞吐量，可选升级为共享内存
+ *  rudp_send_message 逐条发送 1 MiB 的消息，对端用 rudp_recv_message 接收，
+ * 两端代码完全相同，只有是否调用 rudp_enable_shared_memory 不同。
+ * @param mib  传输的总量（MiB）
+ * @param shared  是否开启共享内存
+ */
+static void runShm(int mib, bool shared) {
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (shared) {
+        rudp_enable_shared_memory(server_fd);
+        rudp_enable_shared_memory(fd);
+    }
+    const size_t message_size = 1 << 20;
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        std::vector<char> message;
+        uint32_t expected_seq = 0;
+        for (int i = 0; i < mib; ++i) {
+            rudp_recv_message(server_fd, message, client_addr, expected_seq);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    sockaddr_in addr = server_addr;
+    rudp_connect(fd, addr);
+    bool upgraded = shmChannel(fd) != nullptr;
+    std::vector<char> data(message_size, 'x');
+    uint32_t seq_num = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < mib; ++i) {
+        rudp_send_message(fd, data, addr, seq_num);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    rudp_close_connection(fd, addr);
+    server.join();
+    rudp_disable_shared_memory(fd);
+    rudp_disable_shared_memory(server_fd);
+    close(fd);
+    close(server_fd);
+    printf("shm %-6s upgraded=%d %dMiB %.3fs %.2f MiB/s\n",
+           shared ? "on" : "off", upgraded, mib, seconds, mib / seconds);
+}
+
+static int benchShm(int argc, char* argv[]) {
+    int mib = argc > 0 ? atoi(argv[0]) : 64;
+    runShm(mib, false);
+    runShm(mib, true);
+    return 0;
+}
+
+/**
+ * @brief  生成压缩测试用的文件
+ *  text 是类似日志的文本，容易压缩；random 是随机字节，无法压缩。
+ * @param path  文件路径
+ * @param size  文件大小
+ * @param text  是否生成文本
+ */
+static void writeSample(const std::filesystem::path& path, size_t size,
+                        bool text) {
+    std::mt19937_64 rng(42);
+    std::string data;
+    data.reserve(size + 128);
+    static const char* levels[] = {"INFO", "WARNING", "ERROR"};
+    while (data.size() < size) {
+        if (text) {
+            char line[128];
+            uint64_t r = rng();
+            snprintf(line, sizeof(line),
+                     "I20241018 12:%02d:%02d.%06d rudp.h:%d] %s seq=%d "
+                     "len=%d from 127.0.0.1:%d\n",
+                     static_cast<int>(r % 60), static_cast<int>(r / 60 % 60),
+                     static_cast<int>(r % 1000000),
+                     static_cast<int>(100 + r % 400), levels[r % 3],
+                     static_cast<int>(r >> 40 & 1), static_cast<int>(r % 1008),
+                     static_cast<int>(40000 + (r >> 20) % 1000));
+            data += line;
+        } else {
+            uint64_t r = rng();
+            data.append(reinterpret_cast<const char*>(&r), sizeof(r));
+        }
+    }
+    data.resize(size);
+    FILE* f = fopen(path.c_str(), "wb");
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+}
+
+/**
+ * @brief  消息压缩测试
+ *  把文件内容切成 64 KiB 的消息，用 rudp_send_message 逐条发送，compress 为
+ * true 时两端都开启消息压缩，由握手协商后对每条消息决定是否压缩。
+ * @param file  要发送的文件
+ * @param compress  是否开启消息压缩
+ */
+static void runMessages(const std::filesystem::path& file, bool compress) {
+    std::vector<char> data(std::filesystem::file_size(file));
+    FILE* f = fopen(file.c_str(), "rb");
+    if (f == nullptr || fread(data.data(), 1, data.size(), f) != data.size()) {
+        LOG(ERROR) << "Failed to read " << file;
+        if (f != nullptr) {
+            fclose(f);
+        }
+        return;
+    }
+    fclose(f);
+
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (compress) {
+        rudp_enable_compression(server_fd);
+        rudp_enable_compression(fd);
+    }
+
+    const size_t message_size = 64 << 10;
+    size_t count = (data.size() + message_size - 1) / message_size;
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        std::vector<char> message;
+        uint32_t expected_seq = 0;
+        for (size_t i = 0; i < count; ++i) {
+            rudp_recv_message(server_fd, message, client_addr, expected_seq);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    sockaddr_in addr = server_addr;
+    rudp_connect(fd, addr);
+    uint32_t seq_num = 0;
+    auto start = Clock::now();
+    for (size_t offset = 0; offset < data.size(); offset += message_size) {
+        size_t length = std::min(message_size, data.size() - offset);
+        rudp_send_message(fd, std::span<const char>(data.data() + offset, length),
+                          addr, seq_num);
+    }
+    double elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    rudp_close_connection(fd, addr);
+    server.join();
+    rudp_disable_compression(fd);
+    rudp_disable_compression(server_fd);
+    close(fd);
+    close(server_fd);
+
+    printf("message  %-6s %-4s raw=%.2f MiB/s time=%.3fs\n",
+           file.filename().c_str(), compress ? "lz" : "off",
+           data.size() / elapsed / (1 << 20), elapsed);
+}
+
+/**
+ * @brief  压缩传输测试
+ *  在一条连接上用 sendFiles/receiveFiles 传输一个文件，分别统计原始数据和
+ * 线上数据的吞吐量。每次都写到新的输出目录，避免断点续传跳过已有的块。
+ * @param file  要发送的文件
+ * @param outdir  输出目录
+ * @param compress  是否压缩
+ */
+static void runTransfer(const std::filesystem::path& file,
+                        const std::filesystem::path& outdir, bool compress) {
+    std::filesystem::remove_all(outdir);
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    if (server_fd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return;
+    }
+
+    std::thread server([&] {
+        std::vector<Stream> streams(1);
+        streams[0].sockfd = server_fd;
+        rudp_accept(server_fd, streams[0].addr);
+        TransferStats stats;
+        receiveFiles(
+            streams,
+            [&](const FileEntry& entry) { return (outdir / entry.path).string(); },
+            stats);
+        rudp_wait_close(server_fd, streams[0].addr);
+    });
+
+    std::vector<Stream> streams(1);
+    streams[0].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    streams[0].addr = server_addr;
+    rudp_connect(streams[0].sockfd, streams[0].addr);
+    TransferStats stats;
+    sendFiles(streams, file.string(), stats, compress);
+    rudp_close_connection(streams[0].sockfd, streams[0].addr);
+    server.join();
+    close(streams[0].sockfd);
+    close(server_fd);
+
+    printf("compress %-6s %-4s raw=%.2f MiB/s wire=%.2f MiB/s ratio=%.1f%% "
+           "time=%.3fs\n",
+           file.filename().c_str(), compress ? "lz" : "off",
+           stats.bytes / stats.seconds / (1 << 20),
+           stats.wire / stats.seconds / (1 << 20),
+           100.0 * stats.wire / stats.bytes, stats.seconds);
+}
+
+/**
+ * @brief  压缩编解码速度测试
+ *  不经过网络，只测 lzCompress/lzDecompress 本身的速度和压缩率。
+ * @param file  测试文件
+ */
+static void runCodec(const std::filesystem::path& file) {
+    std::vector<uint8_t> raw(STRIPE_CHUNK_SIZE);
+    std::vector<uint8_t> packed(STRIPE_CHUNK_SIZE);
+    std::vector<uint8_t> unpacked(STRIPE_CHUNK_SIZE);
+    FILE* f = fopen(file.c_str(), "rb");
+    size_t length = fread(raw.data(), 1, raw.size(), f);
+    fclose(f);
+
+    const int rounds = 20;
+    size_t size = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < rounds; ++i) {
+        size = lzCompress(raw.data(), length, packed.data(), length);
+    }
+    double compress_s =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    double decompress_s = 0;
+    if (size > 0) {
+        start = Clock::now();
+        for (int i = 0; i < rounds; ++i) {
+            lzDecompress(packed.data(), size, unpacked.data(), length);
+        }
+        decompress_s =
+            std::chrono::duration<double>(Clock::now() - start).count();
+        if (memcmp(raw.data(), unpacked.data(), length) != 0) {
+            LOG(ERROR) << "Round trip mismatch for " << file;
+        }
+    }
+    if (size == 0) {
+        printf("codec    %-6s compress=%.0f MiB/s incompressible\n",
+               file.filename().c_str(),
+               rounds * length / compress_s / (1 << 20));
+        return;
+    }
+    printf("codec    %-6s compress=%.0f MiB/s decompress=%.0f MiB/s "
+           "ratio=%.1f%%\n",
+           file.filename().c_str(), rounds * length / compress_s / (1 << 20),
+           rounds * length / decompress_s / (1 << 20), 100.0 * size / length);
+}
+
+static int benchCompress(int argc, char* argv[]) {
+    size_t mib = argc > 0 ? atoi(argv[0]) : 8;
+    namespace fs = std::filesystem;
+    fs::path dir = fs::temp_directory_path() / "rudp-bench-compress";
+    fs::create_directories(dir);
+    for (const char* name : {"text", "random"}) {
+        writeSample(dir / name, mib << 20, std::string(name) == "text");
+        runCodec(dir / name);
+        runTransfer(dir / name, dir / "out", false);
+        runTransfer(dir / name, dir / "out", true);
+        runMessages(dir / name, false);
+        runMessages(dir / name, true);
+    }
+    fs::remove_all(dir);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string process_name = argv[0];
+    google::InitGoogleLogging(argv[0]);
+
+    // 日志配置，测试时只输出警告及以上，避免日志本身影响测试结果
+    FLAGS_logtostderr = 1;
+    FLAGS_minloglevel = 1;
+    FLAGS_v = 0;
+
+    if (argc < 2) {
+        LOG(ERROR) << "Usage: " << process_name << " <test> [args]\n"
+                   << "  handshake [total] [clients] [flood_rate]\n"
+                   << "  rpc [count]\n"
+                   << "  pacing [rounds] [window] [rtt_us] [txtime]\n"
+                   << "  pingpong [count]\n"
+                   << "  ackloss [rounds]\n"
+                   << "  compress [mib]\n"
+                   << "  deadline [count] [loss_percent] [deadline_ms] "
+                      "[interval_us]\n"
+                   << "  engine [count]\n"
+                   << "  shm [mib]";
+        return -1;
+    }
+
+    std::string test = argv[1];
+    if (test == "handshake") {
+        return benchHandshake(argc - 2, argv + 2);
+    }
+    if (test == "rpc") {
+        return benchRpc(argc - 2, argv + 2);
+    }
+    if (test == "pacing") {
+        return benchPacing(argc - 2, argv + 2);
+    }
+    if (test == "pingpong") {
+        return benchPingPong(argc - 2, argv + 2);
+    }
+    if (test == "ackloss") {
+        return benchAckLoss(argc - 2, argv + 2);
+    }
+    if (test == "compress") {
+        return benchCompress(argc - 2, argv + 2);
+    }
+    if (test == "deadline") {
+        return benchDeadline(argc - 2, argv + 2);
+    }
+    if (test == "engine") {
+        return benchEngine(argc - 2, argv + 2);
+    }
+    if (test == "shm") {
+        return benchShm(argc - 2, argv + 2);
+    }
+    LOG(ERROR) << "Unknown test: " << test;
+    return -1;
+}
@@ -1,5 +1,6 @@
 // client.cpp
 #include <cstring>  // 为 strncpy 引入头文件
+#include <fstream>
 
 #include "rudp.h"
 
@@ -56,8 +57,21 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    // 连接建立（三次握手）
-    if (rudp_connect(sockfd, server_addr) == 0) {
+    // 读取上次保存的会话恢复令牌，有令牌时可以在 SYN 中直接携带数据
+    std::string token_file =
+        ".rudp_token_" + host + "_" + std::to_string(port);
+    ResumeToken token;
+    std::ifstream token_in(token_file, std::ios::binary);
+    if (!token_in.read(reinterpret_cast<char*>(&token), sizeof(token))) {
+        token = ResumeToken();
+    }
+    token_in.close();
+
+    // 连接建立（三次握手），向服务器发送数据（例如发送 "Hello World"）
+    const char* message = "Hello from Client";
+    ssize_t sent_bytes = rudp_connect_data(sockfd, server_addr, message,
+                                           strlen(message) + 1, token);
+    if (sent_bytes >= 0) {
         LOG(INFO) << "Connected to server";
     } else {
         LOG(ERROR) << "Failed to connect to server";
@@ -65,11 +79,16 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    // 向服务器发送数据（例如发送 "Hello World"）
-    const char* message = "Hello from Client";
-    uint32_t seq_num = 0;
-    ssize_t sent_bytes = rudp_send_data(sockfd, message, strlen(message) + 1,
-                                        server_addr, seq_num);
+    std::ofstream token_out(token_file, std::ios::binary);
+    token_out.write(reinterpret_cast<const char*>(&token), sizeof(token));
+    token_out.close();
+
+    // 服务器没有接受 0-RTT 数据，握手完成后再发送一次
+    if (sent_bytes == 0) {
+        uint32_t seq_num = 0;
+        sent_bytes = rudp_send_data(sockfd, message, strlen(message) + 1,
+                                    server_addr, seq_num);
+    }
     if (sent_bytes > 0) {
         LOG(INFO) << "Sent data to server: " << message;
     } else {
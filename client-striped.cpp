@@ -0,0 +1,103 @@
+// client-striped.cpp
+#include <thread>
+
+#include "transfer.h"
+
+// 并行传输的客户端：把文件切块，或者把目录展开成文件清单，
+// 通过多条连接同时发送给 server-striped。加上 -z 时提出压缩块数据，
+// 加上 -p 时按测得的 RTT 均匀分散各条连接的数据包
+int main(int argc, char* argv[]) {
+    std::string process_name = argv[0];
+    google::InitGoogleLogging(argv[0]);
+
+    // 日志配置
+    // 并行传输时每个数据包一条 INFO 日志会成为瓶颈，这里只输出警告及以上
+    FLAGS_log_dir = "./logs";  // 日志保存目录
+    FLAGS_logtostderr = 1;     // 日志输出到 stderr
+    FLAGS_minloglevel = 1;     // 日志级别: WARNING 及以上
+    FLAGS_colorlogtostderr = true;  // 设置输出到屏幕的日志显示相应颜色
+    FLAGS_colorlogtostdout = true;  // 设置输出到标准输出的日志显示相应颜色
+
+    // 设置了 RUDP_TRACE_DIR 时记录二进制数据包跟踪，用 trace-tool 分析
+    if (rudp_trace_from_env() < 0) {
+        LOG(WARNING) << "Failed to create trace directory";
+    }
+
+    // -t 在 -p 的基础上交给内核 SO_TXTIME 按时间戳发送，需要网卡配置 fq/etf 队列
+    bool compress = false;
+    bool pace = false;
+    bool txtime = false;
+    while (argc > 1 && (std::string(argv[1]) == "-z" ||
+                        std::string(argv[1]) == "-p" ||
+                        std::string(argv[1]) == "-t")) {
+        if (std::string(argv[1]) == "-z") {
+            compress = true;
+        } else if (std::string(argv[1]) == "-p") {
+            pace = true;
+        } else {
+            pace = true;
+            txtime = true;
+        }
+        --argc;
+        ++argv;
+    }
+
+    if (argc != 3 && argc != 4) {
+        LOG(ERROR) << "Usage: " << process_name
+                   << " [-z] [-p] [-t] <host>:<port> <file or directory> "
+                      "[streams]";
+        return -1;
+    }
+
+    std::string host_port = argv[1];
+    std::string path = argv[2];
+    int streams = argc == 4 ? atoi(argv[3])
+                            : static_cast<int>(
+                                  std::thread::hardware_concurrency());
+    if (streams <= 0) {
+        streams = 1;
+    }
+
+    size_t colon_pos = host_port.find(':');
+    if (colon_pos == std::string::npos) {
+        LOG(ERROR) << "Invalid host:port format";
+        return -1;
+    }
+
+    std::string host = host_port.substr(0, colon_pos);
+    int port = atoi(host_port.substr(colon_pos + 1).c_str());
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+
+    // 处理 "localhost" 地址
+    if (host == "localhost") {
+        host = "127.0.0.1";
+    }
+
+    if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) <= 0) {
+        LOG(ERROR) << "Invalid address/ Address not supported";
+        return -1;
+    }
+
+    TransferStats stats;
+    if (sendStriped(server_addr, streams, path, stats, compress, pace,
+                    txtime) < 0) {
+        LOG(ERROR) << "Striped transfer failed";
+        return -1;
+    }
+
+    printf("Sent %llu bytes in %zu files over %zu streams in %.3fs (%.2f MiB/s), "
+           "skipped %llu bytes already present\n",
+           static_cast<unsigned long long>(stats.bytes), stats.files, stats.streams,
+           stats.seconds, stats.bytes / stats.seconds / (1 << 20),
+           static_cast<unsigned long long>(stats.skipped));
+    if (compress) {
+        printf("Compressed to %llu bytes on the wire (%.1f%%, %.2f MiB/s)\n",
+               static_cast<unsigned long long>(stats.wire),
+               stats.bytes ? 100.0 * stats.wire / stats.bytes : 100.0,
+               stats.wire / stats.seconds / (1 << 20));
+    }
+    return 0;
+}
@@ -1,7 +1,5 @@
 // client.cpp
-#include <fstream>
-
-#include "rudp.h"
+#include "transfer.h"
 
 // 客户端实现，发送文件给服务器，然后接收服务器的文件
 int main(int argc, char* argv[]) {
@@ -16,6 +14,11 @@ int main(int argc, char* argv[]) {
     FLAGS_colorlogtostdout = true;  // 设置输出到标准输出的日志显示相应颜色
     FLAGS_v = 2;                    // 设置详细级别
 
+    // 设置了 RUDP_TRACE_DIR 时记录二进制数据包跟踪，用 trace-tool 分析
+    if (rudp_trace_from_env() < 0) {
+        LOG(WARNING) << "Failed to create trace directory";
+    }
+
     if (argc != 3) {
         LOG(ERROR) << "Usage: " << process_name << " <host>:<port> <filename>";
         return -1;
@@ -68,79 +71,34 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    // 发送文件给服务器
-    std::ifstream infile(filename, std::ios::binary);
-    if (!infile) {
-        LOG(ERROR) << "Failed to open file " << filename;
+    // 发送文件给服务器，服务器上已经有的块会被跳过
+    std::vector<Stream> streams(1);
+    streams[0].sockfd = sockfd;
+    streams[0].addr = server_addr;
+    TransferStats stats;
+    if (sendFiles(streams, filename, stats) < 0) {
+        LOG(ERROR) << "Failed to send file " << filename;
         rudp_close_connection(sockfd, server_addr);
         close(sockfd);
         return -1;
     }
-
-    char buffer[DATA_SIZE];
-    ssize_t sent_bytes;
-    uint32_t seq_num = 0;
-    while (infile.read(buffer, DATA_SIZE) || infile.gcount() > 0) {
-        std::streamsize bytes_read = infile.gcount();
-        sent_bytes =
-            rudp_send_data(sockfd, buffer, bytes_read, server_addr, seq_num);
-        if (sent_bytes > 0) {
-            LOG(INFO) << "Sent data chunk of size " << sent_bytes;
-        } else {
-            LOG(ERROR) << "Failed to send data to server";
-            // 处理错误或退出
-            infile.close();
-            rudp_close_connection(sockfd, server_addr);
-            close(sockfd);
-            return -1;
-        }
-        // 如果读取的字节数小于 DATA_SIZE，可能是最后一个数据块
-        if (bytes_read < DATA_SIZE) {
-            break;
-        }
-    }
-
-    infile.close();
-    LOG(INFO) << "File sent to server";
-
-    // 接收服务器发送的文件
-    std::ofstream outfile("received_from_server_" + filename, std::ios::binary);
-    if (!outfile) {
-        LOG(ERROR) << "Failed to create output file";
+    LOG(INFO) << "File sent to server, " << stats.bytes << " bytes sent, "
+              << stats.skipped << " bytes already present";
+
+    // 接收服务器发送的文件，上次中断时已经收到的部分会保留下来
+    std::string outname = "received_from_server_" + filename;
+    if (receiveFiles(
+            streams, [&](const FileEntry&) { return outname; }, stats) < 0) {
+        LOG(ERROR) << "Failed to receive file from server";
         close(sockfd);
         return -1;
     }
-
-    ssize_t received_bytes;
-    uint32_t expected_seq = 0;
-    while (true) {
-        received_bytes = rudp_receive_data(sockfd, buffer, DATA_SIZE,
-                                           server_addr, expected_seq);
-        if (received_bytes > 0) {
-            // 写入接收到的数据到文件
-            outfile.write(buffer, received_bytes);
-            LOG(INFO) << "Received data chunk of size " << received_bytes;
-            if (received_bytes < DATA_SIZE) {
-                // 可能是最后一个数据包
-                break;
-            }
-        } else if (received_bytes == 0) {
-            // 数据接收完成
-            break;
-        } else {
-            LOG(ERROR) << "Failed to receive data from server";
-            // 处理错误或退出
-            outfile.close();
-            close(sockfd);
-            return -1;
-        }
-    }
-
-    outfile.close();
-    LOG(INFO) << "File received from server";
+    LOG(INFO) << "File received from server, " << stats.bytes
+              << " bytes received, " << stats.skipped
+              << " bytes already present";
 
     // 等待服务器关闭连接（四次挥手）
-    if (rudp_wait_close(sockfd, server_addr) == 0) {
+    if (rudp_wait_close(sockfd, streams[0].addr) == 0) {
         LOG(INFO) << "Connection closed by server";
     } else {
         LOG(ERROR) << "Failed during connection termination";
@@ -0,0 +1,262 @@
+// compress.h
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <cstring>
+
+// 数据压缩：LZ4 块格式的快速 LZ77 压缩，以及决定是否值得压缩的自适应策略。
+// 压缩按块进行（例如文件传输中的一个 1 MiB 块），在分片之前完成，
+// 接收方收齐整条消息后再解压。
+
+const int LZ_MIN_MATCH = 4;      // 最短匹配长度
+const int LZ_LAST_LITERALS = 5;  // 块末尾必须是字面量的字节数
+const int LZ_MATCH_LIMIT = 12;   // 匹配的起点距块末尾至少这么多字节
+const int LZ_HASH_BITS = 16;     // 哈希表大小 (2^16 项)
+const int LZ_MAX_OFFSET = 65535;
+
+const double COMPRESS_MIN_RATIO = 0.9;  // 压缩后超过原大小的 90% 就不值得压缩
+const int COMPRESS_BACKOFF = 16;        // 不值得压缩时，接下来跳过的块数
+const double COMPRESS_EWMA = 0.25;      // 统计值的平滑系数
+
+/**
+ * @brief  LZ 压缩
+ *  输出为 LZ4 块格式：每个序列由 token、字面量和 (偏移, 匹配长度) 组成，
+ * 最后一个序列只有字面量。压缩结果放不进 capacity 时返回 0，调用方直接发送
+ * 原始数据即可，所以通常把 capacity 设为原始大小。
+ * @param src  原始数据
+ * @param length  原始数据长度
+ * @param dst  输出缓冲区
+ * @param capacity  输出缓冲区大小
+ * @return size_t  返回压缩后的长度，放不下时返回 0
+ */
+size_t lzCompress(const uint8_t* src, size_t length, uint8_t* dst,
+                  size_t capacity) {
+    static thread_local uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    auto read32 = [src](size_t pos) {
+        uint32_t v;
+        memcpy(&v, src + pos, sizeof(v));
+        return v;
+    };
+    auto hash = [](uint32_t v) {
+        return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+    };
+
+    size_t op = 0;
+    // 写出一个序列，match_length 为 0 表示最后一个只有字面量的序列
+    auto emit = [&](size_t anchor, size_t literals, size_t offset,
+                    size_t match_length) {
+        size_t need = 1 + literals / 255 + 1 + literals +
+                      (match_length ? 2 + match_length / 255 + 1 : 0);
+        if (need > capacity - op) {
+            return false;
+        }
+        uint8_t* token = dst + op++;
+        *token = 0;
+        if (literals >= 15) {
+            *token = 15 << 4;
+            size_t rest = literals - 15;
+            for (; rest >= 255; rest -= 255) {
+                dst[op++] = 255;
+            }
+            dst[op++] = static_cast<uint8_t>(rest);
+        } else {
+            *token = static_cast<uint8_t>(literals << 4);
+        }
+        if (literals > 0) {
+            memcpy(dst + op, src + anchor, literals);
+        }
+        op += literals;
+        if (match_length == 0) {
+            return true;
+        }
+        dst[op++] = static_cast<uint8_t>(offset & 0xff);
+        dst[op++] = static_cast<uint8_t>(offset >> 8);
+        size_t rest = match_length - LZ_MIN_MATCH;
+        if (rest >= 15) {
+            *token |= 15;
+            rest -= 15;
+            for (; rest >= 255; rest -= 255) {
+                dst[op++] = 255;
+            }
+            dst[op++] = static_cast<uint8_t>(rest);
+        } else {
+            *token |= static_cast<uint8_t>(rest);
+        }
+        return true;
+    };
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t attempts = 0;  // 上一次匹配之后查找失败的次数
+    if (length > LZ_MATCH_LIMIT) {
+        const size_t limit = length - LZ_MATCH_LIMIT;
+        const size_t match_end = length - LZ_LAST_LITERALS;
+        while (ip < limit) {
+            uint32_t v = read32(ip);
+            uint32_t h = hash(v);
+            size_t ref = table[h];
+            table[h] = static_cast<uint32_t>(ip);
+            if (ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(ref) == v) {
+                size_t match_length = LZ_MIN_MATCH;
+                while (ip + match_length < match_end &&
+                       src[ref + match_length] == src[ip + match_length]) {
+                    ++match_length;
+                }
+                if (!emit(anchor, ip - anchor, ip - ref, match_length)) {
+                    return 0;
+                }
+                ip += match_length;
+                anchor = ip;
+                attempts = 0;
+            } else {
+                // 很久没有找到匹配时加大步长，不可压缩的数据很快就能扫过去
+                ip += 1 + (attempts++ >> 6);
+            }
+        }
+    }
+    if (!emit(anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+/**
+ * @brief  LZ 解压
+ *  对输入做完整的边界检查，损坏或者伪造的数据只会导致返回 -1。
+ * @param src  压缩数据
+ * @param length  压缩数据长度
+ * @param dst  输出缓冲区
+ * @param capacity  输出缓冲区大小
+ * @return ssize_t  返回解压后的长度，数据损坏时返回 -1
+ */
+ssize_t lzDecompress(const uint8_t* src, size_t length, uint8_t* dst,
+                     size_t capacity) {
+    size_t ip = 0;
+    size_t op = 0;
+    auto read_length = [&](size_t& value) {
+        uint8_t b;
+        do {
+            if (ip >= length) {
+                return false;
+            }
+            b = src[ip++];
+            value += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < length) {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !read_length(literals)) {
+            return -1;
+        }
+        if (literals > length - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == length) {
+            break;  // 最后一个序列只有字面量
+        }
+
+        if (length - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(match_length)) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > capacity - op) {
+            return -1;
+        }
+        // 匹配可能和输出重叠（offset 小于长度），只能逐字节拷贝
+        const uint8_t* ref = dst + op - offset;
+        for (size_t i = 0; i < match_length; ++i) {
+            dst[op + i] = ref[i];
+        }
+        op += match_length;
+    }
+    return op;
+}
+
+/**
+ * @brief  自适应压缩策略
+ *  记录最近的压缩率、每字节压缩耗时和每字节发送耗时。压缩省下的发送时间
+ * 比压缩本身花的时间多才值得压缩；压缩率太低或者 CPU 成了瓶颈时，接下来
+ * COMPRESS_BACKOFF 个块直接发送原始数据，之后再试探一次。
+ */
+struct CompressionPolicy {
+    double ratio;        // 压缩后大小 / 原始大小
+    double compress_ns;  // 每个原始字节的压缩耗时（纳秒）
+    double send_ns;      // 每个线上字节的发送耗时（纳秒）
+    int skip;            // 接下来不压缩的块数
+
+    CompressionPolicy() : ratio(0), compress_ns(0), send_ns(0), skip(0) {}
+};
+
+/**
+ * @brief  下一个块是否尝试压缩
+ */
+bool shouldCompress(CompressionPolicy& policy) {
+    if (policy.skip > 0) {
+        --policy.skip;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief  记录一次压缩的结果，并决定是否暂停压缩
+ * @param policy  压缩策略
+ * @param raw  原始大小
+ * @param compressed  压缩后大小，0 表示压缩后放不下
+ * @param ns  压缩耗时（纳秒）
+ */
+void recordCompress(CompressionPolicy& policy, size_t raw, size_t compressed,
+                    double ns) {
+    double ratio = compressed ? static_cast<double>(compressed) / raw : 1.0;
+    double per_byte = ns / raw;
+    if (policy.compress_ns == 0) {
+        policy.ratio = ratio;
+        policy.compress_ns = per_byte;
+    } else {
+        policy.ratio += COMPRESS_EWMA * (ratio - policy.ratio);
+        policy.compress_ns += COMPRESS_EWMA * (per_byte - policy.compress_ns);
+    }
+    // 压缩节省的发送时间：(1 - ratio) * send_ns，小于压缩耗时就不划算
+    bool cpu_bound = policy.send_ns > 0 &&
+                     policy.compress_ns > (1 - policy.ratio) * policy.send_ns;
+    if (policy.ratio > COMPRESS_MIN_RATIO || cpu_bound) {
+        policy.skip = COMPRESS_BACKOFF;
+    }
+}
+
+/**
+ * @brief  记录一次发送的耗时
+ * @param policy  压缩策略
+ * @param bytes  线上字节数
+ * @param ns  发送耗时（纳秒）
+ */
+void recordSend(CompressionPolicy& policy, size_t bytes, double ns) {
+    double per_byte = ns / bytes;
+    if (policy.send_ns == 0) {
+        policy.send_ns = per_byte;
+    } else {
+        policy.send_ns += COMPRESS_EWMA * (per_byte - policy.send_ns);
+    }
+}
+
+#endif  // COMPRESS_H
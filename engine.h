@@ -0,0 +1,354 @@
+// engine.h
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <sys/select.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "rudp.h"
+
+// 编译期配置的连接引擎：校验、重传超时、收发方式和跟踪都是模板参数，
+// 数据包大小是编译期常量。每种部署选定一组策略后得到一个完全内联的收发路径，
+// 不需要在每个数据包上检查运行时开关，不用的功能（比如日志）不会生成任何代码。
+//
+// 引擎只负责数据阶段，连接仍然由 rudp_connect/rudp_accept 建立、
+// 由 rudp_close_connection/rudp_wait_close 关闭。使用 Fletcher16Integrity 并且
+// 数据包大小为 MAX_BUFFER_SIZE 时，线上格式和 rudp_send_data/rudp_receive_data
+// 完全一致，可以和使用这些函数的对端互通；其他配置要求两端使用相同的策略。
+
+/**
+ * @brief  编译期大小的数据包
+ *  头部和 Packet 相同，数据区大小为 Size - HEADER_SIZE。
+ */
+template <size_t Size>
+struct BasicPacket {
+    static constexpr size_t kSize = Size;
+    static constexpr size_t kDataSize = Size - HEADER_SIZE;
+    static_assert(Size > HEADER_SIZE, "packet must be larger than its header");
+
+    uint32_t type;
+    uint32_t seq;
+    uint32_t checksum;
+    uint32_t data_length;
+    char data[kDataSize];
+};
+
+static_assert(sizeof(BasicPacket<MAX_BUFFER_SIZE>) == sizeof(Packet),
+              "BasicPacket must match the Packet wire layout");
+
+/**
+ * @brief  Fletcher-16 校验
+ *  与 calculateChecksum 的结果完全相同，但直接在数据包上计算，不拷贝，
+ * 并且每 5802 个字节才取一次模。数据包总是按完整大小发送，和 sendPacket 一样。
+ */
+struct Fletcher16Integrity {
+    static constexpr bool kPadded = true;  // 总是发送完整大小的数据包
+
+    static uint16_t fletcher16(const uint8_t* data, size_t len) {
+        uint32_t sum1 = 0;
+        uint32_t sum2 = 0;
+        while (len > 0) {
+            // 5802 个字节内 32 位累加不会溢出
+            size_t block = std::min<size_t>(len, 5802);
+            len -= block;
+            do {
+                sum1 += *data++;
+                sum2 += sum1;
+            } while (--block);
+            sum1 %= 255;
+            sum2 %= 255;
+        }
+        return (sum2 << 8) | sum1;
+    }
+
+    template <typename Pkt>
+    static void seal(Pkt& pkt, size_t) {
+        pkt.checksum = 0;
+        pkt.checksum =
+            fletcher16(reinterpret_cast<const uint8_t*>(&pkt), sizeof(pkt));
+    }
+
+    template <typename Pkt>
+    static bool verify(Pkt& pkt, size_t received) {
+        if (received != sizeof(pkt)) {
+            return false;
+        }
+        uint32_t checksum = pkt.checksum;
+        pkt.checksum = 0;
+        return fletcher16(reinterpret_cast<const uint8_t*>(&pkt),
+                          sizeof(pkt)) == checksum;
+    }
+};
+
+/**
+ * @brief  不校验
+ *  适合本机或者链路层已经有校验的场景，只发送头部和实际数据。
+ */
+struct NoIntegrity {
+    static constexpr bool kPadded = false;
+
+    template <typename Pkt>
+    static void seal(Pkt& pkt, size_t) {
+        pkt.checksum = 0;
+    }
+
+    template <typename Pkt>
+    static bool verify(Pkt&, size_t) {
+        return true;
+    }
+};
+
+/**
+ * @brief  固定的重传超时
+ */
+template <int Ms>
+struct FixedRto {
+    static_assert(Ms > 0, "RTO must be positive");
+
+    constexpr int timeoutMs() const { return Ms; }
+    void onSample(uint64_t) {}
+    void onTimeout() {}
+};
+
+/**
+ * @brief  自适应的重传超时
+ *  按 RFC 6298 维护平滑 RTT 和 RTT 偏差，RTO = SRTT + 4 × RTTVAR，
+ * 超时后加倍，限制在 [MinMs, MaxMs] 之间。只用没有重传过的数据包采样（Karn 算法）。
+ */
+template <int MinMs = 1, int MaxMs = RTO_MS>
+struct AdaptiveRto {
+    static_assert(0 < MinMs && MinMs <= MaxMs, "invalid RTO bounds");
+
+    double srtt_ms = 0;
+    double rttvar_ms = 0;
+    int rto_ms = MaxMs;
+
+    int timeoutMs() const { return rto_ms; }
+
+    void onSample(uint64_t rtt_ns) {
+        double rtt_ms = rtt_ns / 1e6;
+        if (srtt_ms == 0) {
+            srtt_ms = rtt_ms;
+            rttvar_ms = rtt_ms / 2;
+        } else {
+            rttvar_ms += 0.25 * (std::abs(srtt_ms - rtt_ms) - rttvar_ms);
+            srtt_ms += 0.125 * (rtt_ms - srtt_ms);
+        }
+        rto_ms = std::clamp(static_cast<int>(srtt_ms + 4 * rttvar_ms + 1),
+                            MinMs, MaxMs);
+    }
+
+    void onTimeout() { rto_ms = std::min(rto_ms * 2, MaxMs); }
+};
+
+/**
+ * @brief  select 等待后 recvfrom，和 recvPacket 的默认方式相同
+ */
+struct SelectIO {
+    static ssize_t recv(int sockfd, void* buffer, size_t length,
+                        sockaddr_in& addr, int timeout_ms) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
+        timeval timeout{timeout_ms / 1000, timeout_ms % 1000 * 1000};
+        int rv = select(sockfd + 1, &read_fds, NULL, NULL, &timeout);
+        if (rv <= 0) {
+            return rv;
+        }
+        socklen_t addr_len = sizeof(addr);
+        return recvfrom(sockfd, buffer, length, 0, (struct sockaddr*)&addr,
+                        &addr_len);
+    }
+};
+
+/**
+ * @brief  忙等非阻塞 recvfrom，和低延迟模式的 recvPacketBusyPoll 相同
+ */
+struct BusyPollIO {
+    static ssize_t recv(int sockfd, void* buffer, size_t length,
+                        sockaddr_in& addr, int timeout_ms) {
+        uint64_t deadline = monotonicNs() + timeout_ms * 1000000ULL;
+        while (true) {
+            socklen_t addr_len = sizeof(addr);
+            ssize_t n = recvfrom(sockfd, buffer, length, MSG_DONTWAIT,
+                                 (struct sockaddr*)&addr, &addr_len);
+            if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                return n;
+            }
+            if (monotonicNs() >= deadline) {
+                return 0;
+            }
+            sched_yield();
+        }
+    }
+};
+
+/**
+ * @brief  不跟踪，所有钩子都是空函数，编译后不留下任何代码
+ */
+struct NoTrace {
+    void onSend(uint32_t, uint32_t, uint32_t, bool) {}
+    void onRecv(uint32_t, uint32_t, uint32_t) {}
+    void onTimeout(uint32_t, int) {}
+    void onCorrupt() {}
+};
+
+/**
+ * @brief  用 glog 输出每个数据包，和 sendReliable/recvReliable 的日志相同
+ */
+struct GlogTrace {
+    void onSend(uint32_t type, uint32_t seq, uint32_t length, bool retransmit) {
+        LOG(INFO) << (retransmit ? "Resent" : "Sent") << " packet type "
+                  << (type & TYPE_MASK) << " with seq " << seq
+                  << " and length " << length;
+    }
+    void onRecv(uint32_t type, uint32_t seq, uint32_t length) {
+        LOG(INFO) << "Received packet type " << (type & TYPE_MASK)
+                  << " with seq " << seq << " and length " << length;
+    }
+    void onTimeout(uint32_t seq, int rto_ms) {
+        LOG(WARNING) << "Timeout after " << rto_ms << "ms, resending seq "
+                     << seq;
+    }
+    void onCorrupt() { LOG(WARNING) << "Checksum mismatch!"; }
+};
+
+/**
+ * @brief  连接引擎
+ *  停等协议的数据阶段，行为和 sendReliable/recvReliable 相同：发送后等待对应
+ * 序号的 DATA_ACK，超时或者收到错误的应答时重发；收到重复的数据包时重新确认。
+ * 发送时收到对方的新数据包不确认，丢弃后等对方重传，由之后的 receive 交付。
+ * @tparam Integrity  校验策略：Fletcher16Integrity、NoIntegrity
+ * @tparam Rto  重传超时策略：FixedRto、AdaptiveRto
+ * @tparam IO  收包方式：SelectIO、BusyPollIO
+ * @tparam Trace  跟踪策略：NoTrace、GlogTrace
+ * @tparam PacketSize  数据包大小（字节）
+ */
+template <typename Integrity, typename Rto, typename IO, typename Trace,
+          size_t PacketSize = MAX_BUFFER_SIZE>
+class Engine {
+   public:
+    using PacketType = BasicPacket<PacketSize>;
+    static constexpr size_t kDataSize = PacketType::kDataSize;
+    static constexpr size_t kHeaderSize = offsetof(PacketType, data);
+
+    Engine(int sockfd, const sockaddr_in& addr) : sockfd_(sockfd), addr_(addr) {}
+
+    /**
+     * @brief  发送数据，一次最多 kDataSize 字节
+     * @return ssize_t  返回发送的字节数
+     */
+    ssize_t send(const char* data, size_t length) {
+        length = std::min(length, kDataSize);
+        out_.type = DATA;
+        out_.seq = seq_num_;
+        out_.data_length = length;
+        memcpy(out_.data, data, length);
+
+        for (bool retransmit = false;; retransmit = true) {
+            uint64_t sent_at = monotonicNs();
+            transmit(out_);
+            trace_.onSend(out_.type, out_.seq, length, retransmit);
+            int timeout_ms = rto_.timeoutMs();
+            ssize_t n = poll(timeout_ms);
+            if (n > 0 && in_.type == DATA_ACK && in_.seq == seq_num_) {
+                if (!retransmit) {
+                    rto_.onSample(monotonicNs() - sent_at);
+                }
+                seq_num_ ^= 1;
+                return length;
+            } else if (n > 0 && (in_.type & TYPE_MASK) == DATA &&
+                       in_.seq == (expected_seq_ ^ 1)) {
+                // 对方没有收到反方向最后一个数据包的 ACK，重新确认
+                ack(in_.seq);
+            } else if (n == 0) {
+                trace_.onTimeout(seq_num_, timeout_ms);
+                rto_.onTimeout();
+            }
+        }
+    }
+
+    /**
+     * @brief  接收数据，超过 max_length 的部分会被截断
+     * @return ssize_t  返回接收的字节数
+     */
+    ssize_t receive(char* buffer, size_t max_length) {
+        while (true) {
+            ssize_t n = poll(RTO_MS);
+            if (n <= 0 || (in_.type & TYPE_MASK) != DATA) {
+                continue;
+            }
+            if (in_.seq != expected_seq_) {
+                ack(expected_seq_ ^ 1);  // 重复的数据包，重新确认上一个
+                continue;
+            }
+            ack(in_.seq);
+            expected_seq_ ^= 1;
+            size_t length = std::min<size_t>(in_.data_length, max_length);
+            memcpy(buffer, in_.data, length);
+            return length;
+        }
+    }
+
+    Trace& trace() { return trace_; }
+    const Rto& rto() const { return rto_; }
+
+   private:
+    void transmit(PacketType& pkt) {
+        size_t length =
+            Integrity::kPadded ? sizeof(pkt) : kHeaderSize + pkt.data_length;
+        Integrity::seal(pkt, length);
+        sendto(sockfd_, &pkt, length, 0, (const struct sockaddr*)&addr_,
+               sizeof(addr_));
+    }
+
+    void ack(uint32_t seq) {
+        ack_.type = DATA_ACK;
+        ack_.seq = seq;
+        ack_.data_length = 0;
+        transmit(ack_);
+        trace_.onSend(ack_.type, seq, 0, false);
+    }
+
+    /**
+     * @brief  接收一个合法的数据包到 in_
+     * @return ssize_t  返回接收的字节数，超时返回 0，数据包损坏时返回 -1
+     */
+    ssize_t poll(int timeout_ms) {
+        sockaddr_in from;
+        ssize_t n = IO::recv(sockfd_, &in_, sizeof(in_), from, timeout_ms);
+        if (n <= 0) {
+            return n;
+        }
+        if (static_cast<size_t>(n) < kHeaderSize ||
+            in_.data_length > static_cast<size_t>(n) - kHeaderSize ||
+            !Integrity::verify(in_, n)) {
+            trace_.onCorrupt();
+            return -1;
+        }
+        trace_.onRecv(in_.type, in_.seq, in_.data_length);
+        return n;
+    }
+
+    int sockfd_;
+    sockaddr_in addr_;
+    uint32_t seq_num_ = 0;
+    uint32_t expected_seq_ = 0;
+    Rto rto_;
+    [[no_unique_address]] Trace trace_;
+    PacketType out_{};
+    PacketType in_{};
+    PacketType ack_{};
+};
+
+// 和 rudp_send_data/rudp_receive_data 行为相同的配置，可以和它们互通
+using DefaultEngine =
+    Engine<Fletcher16Integrity, FixedRto<RTO_MS>, SelectIO, GlogTrace>;
+
+// 本机或者可信链路上的配置：不校验、不记日志、自适应重传超时
+using LoopbackEngine = Engine<NoIntegrity, AdaptiveRto<>, SelectIO, NoTrace>;
+
+#endif  // ENGINE_H
@@ -0,0 +1,109 @@
+// impair.h
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <atomic>
+#include <functional>
+#include <random>
+#include <thread>
+
+#include "rudp.h"
+
+// 本机测试用的有损链路：客户端连接中继，中继在客户端和服务端之间转发数据包，
+// 按随机丢包率或者调用方给出的规则丢弃。bench 用它模拟丢包，
+// trace-tool 用它按跟踪文件中的丢包位置重放。
+
+/**
+ * @brief  创建绑定到回环地址随机端口的 UDP socket
+ * @param addr  返回实际绑定的地址
+ * @return int  返回 socket 文件描述符，失败返回 -1
+ */
+int bindLoopback(sockaddr_in& addr) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (bind(sockfd, (const struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(sockfd, (struct sockaddr*)&addr, &len) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * @brief  丢包中继
+ *  在客户端和服务端之间双向转发数据包，每个方向都按 loss 的概率随机丢弃，
+ * 模拟有损链路。客户端连接中继的地址，服务端看到的对端是中继。
+ *  设置了 drop 时不再随机丢包，由 drop 逐个决定，参数是数据包和它是否来自服务端。
+ * drop 只在中继线程中调用，需要在 startRelay 之前设置。
+ */
+struct LossyRelay {
+    int fd = -1;
+    sockaddr_in addr{};               // 中继的地址，客户端连接这个地址
+    std::atomic<double> loss{0};      // 丢包率
+    std::function<bool(const Packet&, bool)> drop;
+    std::atomic<bool> done{false};
+    std::thread thread;
+};
+
+/**
+ * @brief  启动丢包中继
+ * @param relay  中继
+ * @param server_addr  服务端地址
+ * @param loss  丢包率
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int startRelay(LossyRelay& relay, const sockaddr_in& server_addr, double loss) {
+    relay.fd = bindLoopback(relay.addr);
+    if (relay.fd < 0) {
+        return -1;
+    }
+    relay.loss = loss;
+    timeval timeout{0, 100000};
+    setsockopt(relay.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    relay.thread = std::thread([&relay, server_addr] {
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<double> coin(0, 1);
+        sockaddr_in client_addr{};
+        Packet pkt;
+        while (!relay.done.load()) {
+            sockaddr_in from{};
+            socklen_t len = sizeof(from);
+            ssize_t n = recvfrom(relay.fd, &pkt, sizeof(pkt), 0,
+                                 (struct sockaddr*)&from, &len);
+            if (n <= 0) {
+                continue;
+            }
+            bool from_server = from.sin_port == server_addr.sin_port &&
+                               from.sin_addr.s_addr == server_addr.sin_addr.s_addr;
+            if (relay.drop ? relay.drop(pkt, from_server)
+                           : coin(rng) < relay.loss.load()) {
+                continue;
+            }
+            if (!from_server) {
+                client_addr = from;
+            }
+            const sockaddr_in& to = from_server ? client_addr : server_addr;
+            sendto(relay.fd, &pkt, n, 0, (const struct sockaddr*)&to,
+                   sizeof(to));
+        }
+    });
+    return 0;
+}
+
+/**
+ * @brief  停止丢包中继
+ */
+void stopRelay(LossyRelay& relay) {
+    relay.done = true;
+    relay.thread.join();
+    close(relay.fd);
+}
+
+#endif  // IMPAIR_H
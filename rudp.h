@@ -3,19 +3,45 @@
 #define RUDP_H
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <glog/logging.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cstring>
+#include <mutex>
+#include <random>
+#include <span>
 #include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "compress.h"
+#include "shm.h"
+#include "trace.h"
 
 // Constants
 const int MAX_BUFFER_SIZE = 1024;
 const int HEADER_SIZE = 16;  // type (4 bytes) + seq (4 bytes) + checksum (4
                              // bytes) + data_length (4 bytes)
 const int DATA_SIZE = MAX_BUFFER_SIZE - HEADER_SIZE;
+const int COOKIE_LIFETIME_SEC = 64;  // SYN cookie 的时间片长度（秒）
+const int TOKEN_LIFETIME_SEC = 24 * 3600;  // 会话恢复令牌的有效期（秒）
+const double PACING_GAIN = 1.25;  // 发送速率相对于估计带宽的放大系数
+const int PACING_BURST = 2;       // 允许连续发送的数据包个数
+const int BUSY_POLL_USEC = 50;    // SO_BUSY_POLL 在驱动队列上忙等的时间（微秒）
+const int MAX_SOCKET_FD = 1024;   // 按 socket 文件描述符索引的设置的上限
+const uint64_t MAX_MESSAGE_SIZE = 64ULL << 20;  // 默认接受的单条消息最大长度
+const int RTO_MS = 1000;  // 默认的重传超时（毫秒）
 
 // Message Types
 enum MessageType {
@@ -28,6 +54,83 @@ enum MessageType {
     FIN_ACK    // 关闭应答
 };
 
+// 分片标志，放在 type 字段的高 16 位，低 16 位仍然是消息类型
+const uint32_t TYPE_MASK = 0xffff;
+const uint32_t FLAG_FRAGMENT = 1u << 16;  // 消息分片，所有分片都带这个标志
+const uint32_t FLAG_FIRST = 1u << 17;     // 消息的第一个分片
+const uint32_t FLAG_LAST = 1u << 18;      // 消息的最后一个分片
+const uint32_t FLAG_SKIP = 1u << 19;      // 发送方放弃了当前消息，接收方跳过
+const uint32_t FLAG_COMPRESSED = 1u << 20;  // 消息经过压缩，只放在第一个分片上
+
+/**
+ * @brief  0-RTT 数据的防重放策略
+ *  0-RTT 数据在握手完成前就被交付，攻击者可以原样重放 SYN，让服务端重复处理。
+ */
+enum ReplayProtection {
+    REPLAY_NONE,      // 不防重放，SYN 重传也可能导致数据被重复交付
+    REPLAY_CACHE,     // 记录令牌有效期内已交付的 SYN，拒绝重复交付
+    REPLAY_DISABLED,  // 关闭 0-RTT，所有数据都在握手完成后发送
+};
+
+// 服务端使用的防重放策略，在调用 rudp_accept_data 之前设置
+ReplayProtection rudp_replay_protection = REPLAY_CACHE;
+
+/**
+ * @brief  一个 socket 的低延迟模式设置
+ *  开启后这个 socket 上的 recvPacket 不再用 select 睡眠等待，而是忙等非阻塞的
+ * recvfrom。绑核时保存线程原来的 CPU 亲和性，关闭时恢复。
+ */
+struct LowLatency {
+    std::atomic<bool> busy_poll{false};
+    bool pinned = false;  // 是否修改过线程的 CPU 亲和性
+    cpu_set_t saved_cpus;  // 绑核之前的 CPU 亲和性
+};
+
+// 低延迟模式，按 socket 文件描述符索引。通过 rudp_enable_low_latency 开启，
+// rudp_disable_low_latency 关闭
+LowLatency rudp_low_latency[MAX_SOCKET_FD];
+
+/**
+ * @brief  一个 socket 上的消息压缩
+ *  本端开启后在握手中告诉对端自己可以解压；对端也表明可以解压时，
+ * rudp_send_message 先压缩超过一个数据包的消息再分片发送。
+ */
+struct MessageCompression {
+    bool enabled = false;       // 本端开启了压缩
+    bool peer = false;          // 对端可以解压，本端发送的消息可以压缩
+    CompressionPolicy policy;   // 决定是否值得压缩
+    std::vector<char> buffer;   // 压缩结果
+};
+
+// 消息压缩，按 socket 文件描述符索引。通过 rudp_enable_compression 开启
+MessageCompression rudp_compression[MAX_SOCKET_FD];
+
+// 共享内存快速通道，按 socket 文件描述符索引：两端都开启并且对端是本机回环
+// 地址时，握手后把连接升级为共享内存环形队列，收发接口不变。
+// 通过 rudp_enable_shared_memory 在 rudp_connect/rudp_accept 之前开启
+bool rudp_shared_memory[MAX_SOCKET_FD] = {};
+
+// 已经升级的连接，按 socket 文件描述符索引
+ShmChannel* rudp_shm_channels[MAX_SOCKET_FD] = {};
+
+struct Pacer;
+
+/**
+ * @brief  消息的可靠性策略
+ *  默认完全可靠，一直重传到收到 ACK。实时数据（遥测、媒体帧）过期就没有用了，
+ * 可以限制重传次数或者设置期限，超过后发送方放弃这条消息，并用一个带
+ * FLAG_SKIP 的空数据包通知接收方跳过，接收方不会一直等待这个空洞。
+ */
+struct DeliveryPolicy {
+    int max_retransmits = -1;  // 最大重传次数，-1 表示不限
+    uint64_t deadline_ns = 0;  // 放弃的时刻（monotonicNs），0 表示没有期限
+    int rto_ms = RTO_MS;       // 重传超时（毫秒）
+    Pacer* pacer = nullptr;    // 不为空时按节奏发送，并用 ACK 更新它的 RTT
+    // 接收方向期望的序号。同一条连接上两个方向交替收发时设置，等待 ACK 期间
+    // 收到对方重传的上一个数据包（本端的 ACK 丢了）时重新确认它
+    const uint32_t* expected_seq = nullptr;
+};
+
 /**
  * @brief  数据包结构
  *  这里全部使用无符号整型，并且指定大小，以保证在不同平台上的一致性。
@@ -44,6 +147,9 @@ struct Packet {
     }
 };
 
+static_assert(sizeof(Packet) <= SHM_SLOT_SIZE,
+              "a packet must fit in a shared memory slot");
+
 // /**
 //  * @brief 计算校验和
 //  *  这里实现一个最简单的校验和计算方法，将所有字段相加。
@@ -116,27 +222,344 @@ ssize_t sendPacket(int sockfd, const Packet& pkt, const sockaddr_in& addr) {
     // 结构体的指针，该结构体包含目标地址的信息（IP地址和端口号）。 addrlen:
     // dest_addr 结构体的大小。
     // 返回值：成功时返回发送的字节数，失败时返回-1并设置errno。
+    traceRecord(TRACE_SEND, pkt.type, pkt.seq, pkt.data_length, addr);
     ssize_t bytes_sent = sendto(sockfd, &send_pkt, sizeof(send_pkt), 0,
                                 (const struct sockaddr*)&addr, sizeof(addr));
     return bytes_sent;
 }
 
+/**
+ * @brief  发送节奏控制（pacing）
+ *  把一个窗口的数据包均匀地分散到一个 RTT 内发送，而不是一次性全部发出，
+ * 避免瞬间的突发流量打满交换机缓冲区或接收方的 socket 缓冲区而丢包。
+ *  内部是一个令牌桶：next_ns 是下一个数据包最早的发送时间，桶深为
+ * PACING_BURST 个数据包。
+ */
+struct Pacer {
+    double rate;       // 发送速率（字节/秒），0 表示不限速
+    uint64_t next_ns;  // 下一个数据包最早的发送时间（CLOCK_MONOTONIC）
+    bool txtime;       // 为 true 时交给内核 SO_TXTIME 按时间戳发送
+    double cwnd;       // 在途字节数，pacerSampleRtt 用它和 RTT 计算速率
+    double srtt;       // 平滑 RTT（秒），还没有样本时为 0
+    std::mutex mutex;  // 多个线程共用一个 Pacer 时保护上面的字段
+
+    Pacer() : rate(0), next_ns(0), txtime(false), cwnd(0), srtt(0) {}
+};
+
+/**
+ * @brief  当前单调时钟时间（纳秒）
+ *  SO_TXTIME 使用的也是 CLOCK_MONOTONIC，两边时间基准一致。
+ */
+uint64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief  在 socket 上开启 SO_TXTIME
+ *  SO_TXTIME 按 socket 开启，多个 socket 共用一个 Pacer 时每个 socket 都要开启，
+ * 否则带发送时间戳的 sendmsg 会失败。
+ * @param sockfd  socket 文件描述符
+ * @return bool  开启成功返回 true
+ */
+bool enableTxtime(int sockfd) {
+    sock_txtime cfg{};
+    cfg.clockid = CLOCK_MONOTONIC;
+    cfg.flags = 0;
+    return setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+}
+
+/**
+ * @brief  初始化发送节奏控制
+ *  use_txtime 为 true 时尝试开启 SO_TXTIME，由内核的 fq/etf 队列在指定时间发包，
+ * 不占用 CPU 忙等；内核不支持时退回到用户态令牌桶。注意网卡上没有配置 fq/etf
+ * 队列时，内核会忽略时间戳，所以需要由调用方确认环境后再开启。
+ * @param sockfd  socket 文件描述符
+ * @param pacer  要初始化的 Pacer
+ * @param use_txtime  是否尝试使用 SO_TXTIME
+ */
+void pacerInit(int sockfd, Pacer& pacer, bool use_txtime) {
+    pacer.rate = 0;
+    pacer.next_ns = 0;
+    pacer.txtime = false;
+    pacer.cwnd = 0;
+    pacer.srtt = 0;
+    if (use_txtime) {
+        pacer.txtime = enableTxtime(sockfd);
+        if (!pacer.txtime) {
+            LOG(WARNING) << "SO_TXTIME not available, using userspace pacing";
+        }
+    }
+}
+
+/**
+ * @brief  根据拥塞控制的估计值设置发送速率
+ *  速率 = 拥塞窗口 / 平滑 RTT，再乘上 PACING_GAIN 留出余量，
+ * 保证 pacing 本身不会成为瓶颈。
+ * @param pacer  Pacer
+ * @param cwnd_bytes  拥塞窗口（字节）
+ * @param srtt_sec  平滑 RTT（秒）
+ */
+void pacerSetRate(Pacer& pacer, double cwnd_bytes, double srtt_sec) {
+    pacer.rate = srtt_sec > 0 ? PACING_GAIN * cwnd_bytes / srtt_sec : 0;
+    rudp_trace_state.cwnd = cwnd_bytes;
+}
+
+/**
+ * @brief  用一个 RTT 样本更新平滑 RTT，并按 cwnd / srtt 重新设置发送速率
+ *  平滑方式与 TCP 相同（srtt = 7/8 srtt + 1/8 样本）。cwnd 为 0 时只记录 RTT。
+ * 可以由多个线程同时调用。
+ * @param pacer  Pacer
+ * @param rtt_sec  RTT 样本（秒），只应取自没有重传过的数据包
+ */
+void pacerSampleRtt(Pacer& pacer, double rtt_sec) {
+    std::lock_guard<std::mutex> lock(pacer.mutex);
+    pacer.srtt = pacer.srtt > 0 ? 0.875 * pacer.srtt + 0.125 * rtt_sec : rtt_sec;
+    if (pacer.cwnd > 0) {
+        pacerSetRate(pacer, pacer.cwnd, pacer.srtt);
+    }
+}
+
+/**
+ * @brief  计算数据包的发送时间，并推进令牌桶
+ * @param pacer  Pacer
+ * @param bytes  数据包大小
+ * @return uint64_t  返回数据包的发送时间（纳秒），不限速时返回 0
+ */
+uint64_t pacerSchedule(Pacer& pacer, size_t bytes) {
+    std::lock_guard<std::mutex> lock(pacer.mutex);
+    if (pacer.rate <= 0) {
+        return 0;
+    }
+    uint64_t now = monotonicNs();
+    uint64_t interval = static_cast<uint64_t>(bytes * 1e9 / pacer.rate);
+    // 空闲一段时间后最多只能攒下 PACING_BURST 个包的令牌
+    uint64_t burst = interval * PACING_BURST;
+    if (pacer.next_ns + burst < now) {
+        pacer.next_ns = now - burst;
+    }
+    uint64_t send_ns = pacer.next_ns > now ? pacer.next_ns : now;
+    pacer.next_ns += interval;
+    return send_ns;
+}
+
+/**
+ * @brief  按节奏发送数据包
+ *  使用 SO_TXTIME 时把发送时间放进控制消息，立即返回；否则在用户态等到发送
+ * 时间：时间较长时先睡眠，最后一小段忙等，保证微秒级精度。
+ * @param sockfd  socket 文件描述符
+ * @param pkt  要发送的数据包
+ * @param addr  目标地址
+ * @param pacer  Pacer
+ * @return ssize_t  返回发送的字节数
+ */
+ssize_t sendPacketPaced(int sockfd, const Packet& pkt, const sockaddr_in& addr,
+                        Pacer& pacer) {
+    uint64_t send_ns = pacerSchedule(pacer, sizeof(Packet));
+    if (send_ns == 0) {
+        return sendPacket(sockfd, pkt, addr);
+    }
+
+    if (pacer.txtime) {
+        Packet send_pkt = pkt;
+        send_pkt.checksum = 0;
+        send_pkt.checksum = calculateChecksum(send_pkt);
+        iovec iov{&send_pkt, sizeof(send_pkt)};
+        char control[CMSG_SPACE(sizeof(uint64_t))] = {};
+        msghdr msg{};
+        msg.msg_name = const_cast<sockaddr_in*>(&addr);
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &send_ns, sizeof(uint64_t));
+        traceRecord(TRACE_SEND, pkt.type, pkt.seq, pkt.data_length, addr);
+        return sendmsg(sockfd, &msg, 0);
+    }
+
+    const uint64_t spin_ns = 50000;  // 最后 50us 忙等
+    uint64_t now = monotonicNs();
+    if (send_ns > now + spin_ns) {
+        uint64_t sleep_ns = send_ns - now - spin_ns;
+        timespec ts{static_cast<time_t>(sleep_ns / 1000000000ULL),
+                    static_cast<long>(sleep_ns % 1000000000ULL)};
+        nanosleep(&ts, nullptr);
+    }
+    // 忙等时让出 CPU，避免在核数较少的机器上饿死同机的接收方
+    while (monotonicNs() < send_ns) {
+        sched_yield();
+    }
+    return sendPacket(sockfd, pkt, addr);
+}
+
+/**
+ * @brief  校验接收到的数据包
+ * @param pkt  接收到的数据包，校验后 checksum 字段被清零
+ * @return bool  校验和匹配返回 true
+ */
+bool verifyChecksum(Packet& pkt) {
+    uint32_t received_checksum = pkt.checksum;
+    pkt.checksum = 0;
+    uint32_t calculated_checksum = calculateChecksum(pkt);
+    if (received_checksum != calculated_checksum) {
+        LOG(WARNING) << "Checksum mismatch!";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief  校验接收到的数据包并记录跟踪事件
+ * @return bool  校验和匹配返回 true
+ */
+bool traceReceived(Packet& pkt, const sockaddr_in& addr) {
+    if (!verifyChecksum(pkt)) {
+        traceRecord(TRACE_CORRUPT, pkt.type, pkt.seq, 0, addr);
+        return false;
+    }
+    traceRecord(TRACE_RECV, pkt.type, pkt.seq, pkt.data_length, addr);
+    return true;
+}
+
+/**
+ * @brief  开启低延迟模式
+ *  小包请求/响应场景下，select 睡眠再被唤醒的路径每一跳要多花几十微秒。
+ * 低延迟模式下 recvPacket 改为忙等，同时给 socket 设置 SO_BUSY_POLL，
+ * 让内核在驱动队列上忙等，并把当前线程绑定到指定 CPU，避免被迁移打断。
+ *  忙等会一直占用 CPU，只适合延迟敏感并且有空闲核的场景。只对这个 socket
+ * 生效，关闭 socket 之前应调用 rudp_disable_low_latency，否则复用这个文件
+ * 描述符的新 socket 也会忙等。
+ * @param sockfd  socket 文件描述符
+ * @param cpu  绑定的 CPU 编号，小于 0 表示不绑定
+ * @return int  返回 0 表示成功，SO_BUSY_POLL 或绑核失败时返回 -1，
+ * 但忙等接收仍然会开启；文件描述符超出 MAX_SOCKET_FD 时返回 -1，不开启
+ */
+int rudp_enable_low_latency(int sockfd, int cpu) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKET_FD) {
+        return -1;
+    }
+    LowLatency& mode = rudp_low_latency[sockfd];
+    int ret = 0;
+    mode.busy_poll = true;
+
+    int busy_poll = BUSY_POLL_USEC;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(busy_poll)) < 0) {
+        LOG(WARNING) << "SO_BUSY_POLL not available";
+        ret = -1;
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        // 重复开启时保留最初的亲和性
+        if (!mode.pinned &&
+            pthread_getaffinity_np(pthread_self(), sizeof(mode.saved_cpus),
+                                   &mode.saved_cpus) != 0) {
+            LOG(WARNING) << "Failed to read CPU affinity";
+            ret = -1;
+        } else if (pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                                          &cpus) != 0) {
+            LOG(WARNING) << "Failed to pin thread to CPU " << cpu;
+            ret = -1;
+        } else {
+            mode.pinned = true;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief  关闭低延迟模式
+ *  recvPacket 恢复用 select 等待，关闭 SO_BUSY_POLL。开启时绑过核的话，
+ * 恢复当前线程原来的 CPU 亲和性，所以要在开启时的同一个线程中调用。
+ * @param sockfd  socket 文件描述符
+ * @return int  返回 0 表示成功，-1 表示没有完全恢复
+ */
+int rudp_disable_low_latency(int sockfd) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKET_FD) {
+        return -1;
+    }
+    LowLatency& mode = rudp_low_latency[sockfd];
+    if (!mode.busy_poll.exchange(false)) {
+        return 0;
+    }
+    int ret = 0;
+    int busy_poll = 0;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(busy_poll)) < 0) {
+        ret = -1;
+    }
+    if (mode.pinned) {
+        mode.pinned = false;
+        if (pthread_setaffinity_np(pthread_self(), sizeof(mode.saved_cpus),
+                                   &mode.saved_cpus) != 0) {
+            LOG(WARNING) << "Failed to restore CPU affinity";
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief  忙等接收数据包
+ *  用 MSG_DONTWAIT 反复尝试 recvfrom，直到收到数据包或超时。忙等时让出 CPU，
+ * 没有其他线程可运行时 sched_yield 会立即返回，不影响延迟。
+ * @param sockfd  socket 文件描述符
+ * @param pkt  接收到的数据包
+ * @param addr  发送方地址
+ * @param timeout_ms  超时时间（毫秒）
+ * @return ssize_t  返回接收的字节数，超时返回 0，出错返回 -1
+ */
+ssize_t recvPacketBusyPoll(int sockfd, Packet& pkt, sockaddr_in& addr,
+                           int timeout_ms) {
+    uint64_t deadline = monotonicNs() + timeout_ms * 1000000ULL;
+    while (true) {
+        socklen_t addr_len = sizeof(addr);
+        ssize_t bytes_received =
+            recvfrom(sockfd, &pkt, sizeof(pkt), MSG_DONTWAIT,
+                     (struct sockaddr*)&addr, &addr_len);
+        if (bytes_received >= 0) {
+            return traceReceived(pkt, addr) ? bytes_received : -1;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recvfrom");
+            return -1;
+        }
+        if (monotonicNs() >= deadline) {
+            return 0;  // Timeout occurred
+        }
+        sched_yield();
+    }
+}
+
 /**
  * @brief  接收数据包
  *  接收数据包时，需要验证校验和，如果校验和不匹配，则返回 -1。
  * @param sockfd  socket 文件描述符
  * @param pkt  接收到的数据包
  * @param addr  发送方地址
- * @param timeout_sec  超时时间（秒）
+ * @param timeout_ms  超时时间（毫秒）
  * @return ssize_t  返回接收的字节数
  */
 ssize_t recvPacket(int sockfd, Packet& pkt, sockaddr_in& addr,
-                   int timeout_sec = 1) {
+                   int timeout_ms = RTO_MS) {
     socklen_t addr_len = sizeof(addr);
+    if (sockfd >= 0 && sockfd < MAX_SOCKET_FD &&
+        rudp_low_latency[sockfd].busy_poll.load(std::memory_order_relaxed)) {
+        return recvPacketBusyPoll(sockfd, pkt, addr, timeout_ms);
+    }
     fd_set read_fds;
     struct timeval timeout;
-    timeout.tv_sec = timeout_sec;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = timeout_ms % 1000 * 1000;
 
     FD_ZERO(&read_fds);
     FD_SET(sockfd, &read_fds);
@@ -178,51 +601,567 @@ ssize_t recvPacket(int sockfd, Packet& pkt, sockaddr_in& addr,
         // 返回值：成功时返回接收的字节数，失败时返回-1并设置errno。
         ssize_t bytes_received = recvfrom(sockfd, &pkt, sizeof(pkt), 0,
                                           (struct sockaddr*)&addr, &addr_len);
-        uint32_t received_checksum = pkt.checksum;
-        pkt.checksum = 0;
-        uint32_t calculated_checksum = calculateChecksum(pkt);
-        if (received_checksum != calculated_checksum) {
-            LOG(WARNING) << "Checksum mismatch!";
+        if (!traceReceived(pkt, addr)) {
             return -1;  // Indicate checksum error
         }
         return bytes_received;
     }
 }
 
+/**
+ * @brief  SipHash-2-4
+ *  带密钥的 64 位哈希，用于生成无法伪造的 SYN cookie。
+ * @param key  128 位密钥
+ * @param data  输入数据
+ * @param len  数据长度
+ * @return uint64_t  返回哈希值
+ */
+uint64_t siphash24(const uint64_t key[2], const uint8_t* data, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    auto round = [&]() {
+        v0 += v1;
+        v1 = rotl(v1, 13);
+        v1 ^= v0;
+        v0 = rotl(v0, 32);
+        v2 += v3;
+        v3 = rotl(v3, 16);
+        v3 ^= v2;
+        v0 += v3;
+        v3 = rotl(v3, 21);
+        v3 ^= v0;
+        v2 += v1;
+        v1 = rotl(v1, 17);
+        v1 ^= v2;
+        v2 = rotl(v2, 32);
+    };
+
+    size_t tail = len & 7;
+    const uint8_t* end = data + (len - tail);
+    for (const uint8_t* p = data; p != end; p += 8) {
+        uint64_t m;
+        memcpy(&m, p, 8);
+        v3 ^= m;
+        round();
+        round();
+        v0 ^= m;
+    }
+
+    uint64_t b = static_cast<uint64_t>(len) << 56;
+    for (size_t i = 0; i < tail; ++i) {
+        b |= static_cast<uint64_t>(end[i]) << (8 * i);
+    }
+    v3 ^= b;
+    round();
+    round();
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    round();
+    round();
+    round();
+    round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * @brief  SYN cookie 密钥
+ *  进程启动后第一次使用时随机生成，之后保持不变。
+ */
+const uint64_t* cookieKey() {
+    static const uint64_t* key = [] {
+        static uint64_t k[2];
+        std::random_device rd;
+        k[0] = (static_cast<uint64_t>(rd()) << 32) | rd();
+        k[1] = (static_cast<uint64_t>(rd()) << 32) | rd();
+        return k;
+    }();
+    return key;
+}
+
+/**
+ * @brief  计算 SYN cookie
+ *  对客户端地址、端口和时间片做带密钥的哈希，握手状态全部编码在 cookie 里，
+ *  服务端在收到合法的 ACK 之前不需要保存任何连接状态。
+ * @param addr  客户端地址
+ * @param slot  时间片编号
+ * @return uint32_t  返回 cookie
+ */
+uint32_t makeCookie(const sockaddr_in& addr, uint64_t slot) {
+    uint8_t buf[sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint64_t)];
+    memcpy(buf, &addr.sin_addr.s_addr, sizeof(uint32_t));
+    memcpy(buf + sizeof(uint32_t), &addr.sin_port, sizeof(uint16_t));
+    memcpy(buf + sizeof(uint32_t) + sizeof(uint16_t), &slot, sizeof(uint64_t));
+    return static_cast<uint32_t>(siphash24(cookieKey(), buf, sizeof(buf)));
+}
+
+/**
+ * @brief  当前的 cookie 时间片
+ */
+uint64_t cookieSlot() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(now).count() /
+           COOKIE_LIFETIME_SEC;
+}
+
+/**
+ * @brief  校验 SYN cookie
+ *  接受当前和上一个时间片生成的 cookie，避免恰好跨越时间片边界的握手失败。
+ * @param addr  客户端地址
+ * @param cookie  ACK 中回显的 cookie
+ * @return bool  cookie 合法返回 true
+ */
+bool checkCookie(const sockaddr_in& addr, uint32_t cookie) {
+    uint64_t slot = cookieSlot();
+    return cookie == makeCookie(addr, slot) ||
+           cookie == makeCookie(addr, slot - 1);
+}
+
+/**
+ * @brief  会话恢复令牌
+ *  服务端在每个 SYN-ACK 中签发，客户端保存后，下次连接时放在 SYN 里，
+ * 就可以在第一个数据包中携带数据（0-RTT）。令牌只绑定客户端 IP，不绑定端口。
+ */
+struct ResumeToken {
+    uint32_t issued;  // 签发时间（秒），全零表示没有令牌
+    uint32_t mac;     // 对客户端 IP 和签发时间的带密钥哈希
+
+    ResumeToken() : issued(0), mac(0) {}
+
+    bool empty() const { return issued == 0 && mac == 0; }
+};
+
+/**
+ * @brief  SYN-ACK 携带的数据
+ *  服务端在 SYN-ACK 的 data 字段中放入新令牌，并告诉客户端 0-RTT 数据是否被接受。
+ */
+struct SynAckInfo {
+    ResumeToken token;
+    uint32_t early_accepted;
+    uint32_t shared_memory;  // 服务端愿意升级为共享内存
+    uint32_t compression;    // 服务端可以解压消息
+};
+
+/**
+ * @brief  客户端在 ACK 中告诉服务端的信息
+ */
+struct AckInfo {
+    ShmOffer offer;          // 共享内存，magic 不是 SHM_MAGIC 表示不升级
+    uint32_t compression;    // 客户端可以解压消息
+};
+
+/**
+ * @brief  查找 socket 的消息压缩设置
+ * @return MessageCompression*  文件描述符超出范围时返回空指针
+ */
+MessageCompression* messageCompression(int sockfd) {
+    return sockfd >= 0 && sockfd < MAX_SOCKET_FD ? &rudp_compression[sockfd]
+                                                 : nullptr;
+}
+
+/**
+ * @brief  开启消息压缩
+ *  在 rudp_connect/rudp_accept 之前调用。握手时两端都开启的方向才会压缩：
+ * 服务端在 SYN-ACK 中表明可以解压，客户端在 ACK 中表明可以解压。0-RTT
+ * 数据被接受时没有 ACK，这条连接上只有客户端发送的消息会压缩。
+ * 压缩的消息在第一个分片上带 FLAG_COMPRESSED，接收方收齐后解压。
+ *  设置按文件描述符保存，关闭 socket 之前应调用 rudp_disable_compression，
+ * 否则复用这个文件描述符的新 socket 也会开启压缩。
+ * @param sockfd  socket 文件描述符
+ * @return int  返回 0 表示成功，文件描述符超出 MAX_SOCKET_FD 时返回 -1
+ */
+int rudp_enable_compression(int sockfd) {
+    MessageCompression* compression = messageCompression(sockfd);
+    if (compression == nullptr) {
+        return -1;
+    }
+    compression->enabled = true;
+    return 0;
+}
+
+/**
+ * @brief  关闭消息压缩，之后发送的消息都不再压缩
+ * @param sockfd  socket 文件描述符
+ */
+void rudp_disable_compression(int sockfd) {
+    if (MessageCompression* compression = messageCompression(sockfd)) {
+        compression->enabled = false;
+        compression->peer = false;
+        compression->buffer = std::vector<char>();
+    }
+}
+
+/**
+ * @brief  握手开始时清除上一条连接协商的结果
+ */
+void resetCompression(int sockfd) {
+    if (MessageCompression* compression = messageCompression(sockfd)) {
+        compression->peer = false;
+        compression->policy = CompressionPolicy();
+    }
+}
+
+/**
+ * @brief  记录对端是否可以解压
+ * @param sockfd  socket 文件描述符
+ * @param peer  对端在握手中表明可以解压
+ */
+void setCompressionPeer(int sockfd, bool peer) {
+    MessageCompression* compression = messageCompression(sockfd);
+    if (compression != nullptr && compression->enabled && peer) {
+        compression->peer = true;
+        LOG(INFO) << "Message compression enabled";
+    }
+}
+
+/**
+ * @brief  本端是否开启了消息压缩
+ */
+bool compressionEnabled(int sockfd) {
+    MessageCompression* compression = messageCompression(sockfd);
+    return compression != nullptr && compression->enabled;
+}
+
+/**
+ * @brief  是否是本机回环地址 (127.0.0.0/8)
+ */
+bool isLoopback(const sockaddr_in& addr) {
+    return (ntohl(addr.sin_addr.s_addr) >> 24) == 127;
+}
+
+/**
+ * @brief  开启共享内存快速通道
+ *  只对这个 socket 之后的握手生效。设置按文件描述符保存，关闭 socket 之前
+ * 应调用 rudp_disable_shared_memory，否则复用这个文件描述符的新 socket 也会开启。
+ * @param sockfd  socket 文件描述符
+ * @return int  返回 0 表示成功，文件描述符超出 MAX_SOCKET_FD 时返回 -1
+ */
+int rudp_enable_shared_memory(int sockfd) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKET_FD) {
+        return -1;
+    }
+    rudp_shared_memory[sockfd] = true;
+    return 0;
+}
+
+/**
+ * @brief  关闭共享内存快速通道，已经升级的连接不受影响
+ * @param sockfd  socket 文件描述符
+ */
+void rudp_disable_shared_memory(int sockfd) {
+    if (sockfd >= 0 && sockfd < MAX_SOCKET_FD) {
+        rudp_shared_memory[sockfd] = false;
+    }
+}
+
+/**
+ * @brief  这个 socket 与对端之间是否可以使用共享内存
+ */
+bool sharedMemoryAllowed(int sockfd, const sockaddr_in& addr) {
+    return sockfd >= 0 && sockfd < MAX_SOCKET_FD &&
+           rudp_shared_memory[sockfd] && isLoopback(addr);
+}
+
+/**
+ * @brief  查找 socket 对应的共享内存通道
+ * @return ShmChannel*  没有升级时返回空指针
+ */
+ShmChannel* shmChannel(int sockfd) {
+    return sockfd >= 0 && sockfd < MAX_SOCKET_FD ? rudp_shm_channels[sockfd]
+                                                  : nullptr;
+}
+
+/**
+ * @brief  把通道登记到 socket 上，之前的通道会被释放
+ */
+void shmRegister(int sockfd, ShmChannel* channel) {
+    if (sockfd < 0 || sockfd >= MAX_SOCKET_FD) {
+        shmDestroy(channel);
+        return;
+    }
+    if (rudp_shm_channels[sockfd] != nullptr) {
+        shmDestroy(rudp_shm_channels[sockfd]);
+    }
+    rudp_shm_channels[sockfd] = channel;
+}
+
+/**
+ * @brief  释放 socket 上的通道，连接恢复为 UDP
+ */
+void shmUnregister(int sockfd) {
+    ShmChannel* channel = shmChannel(sockfd);
+    if (channel != nullptr) {
+        rudp_shm_channels[sockfd] = nullptr;
+        shmDestroy(channel);
+    }
+}
+
+/**
+ * @brief  当前的墙上时间（Unix 时间，秒）
+ *  令牌要在服务端重启之后仍然有效，不能使用每次开机重新计数的 steady_clock。
+ */
+uint32_t nowSeconds() {
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::seconds>(now).count();
+}
+
+// 会话恢复令牌的密钥，由 rudp_load_token_key 从文件加载；没有加载时使用
+// 进程内随机生成的 cookie 密钥，进程重启后之前签发的令牌全部失效
+uint64_t rudp_token_key[2];
+bool rudp_token_key_loaded = false;
+
+/**
+ * @brief  从文件加载会话恢复令牌的密钥
+ *  文件不存在时随机生成一个新密钥并以 0600 权限写入，之后重启的服务端
+ * 读到同一个密钥，签发过的令牌继续有效。在 rudp_accept_data 之前调用。
+ * @param path  密钥文件路径
+ * @return int  返回 0 表示成功，-1 表示文件无法读取或创建
+ */
+int rudp_load_token_key(const std::string& path) {
+    uint64_t key[2];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, key, sizeof(key));
+        close(fd);
+        if (n != sizeof(key)) {
+            return -1;
+        }
+    } else {
+        std::random_device rd;
+        for (uint64_t& k : key) {
+            k = (static_cast<uint64_t>(rd()) << 32) | rd();
+        }
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return -1;
+        }
+        ssize_t n = write(fd, key, sizeof(key));
+        close(fd);
+        if (n != sizeof(key)) {
+            unlink(path.c_str());
+            return -1;
+        }
+    }
+    memcpy(rudp_token_key, key, sizeof(key));
+    rudp_token_key_loaded = true;
+    return 0;
+}
+
+/**
+ * @brief  会话恢复令牌的密钥
+ */
+const uint64_t* tokenKey() {
+    return rudp_token_key_loaded ? rudp_token_key : cookieKey();
+}
+
+/**
+ * @brief  计算令牌的 MAC
+ * @param addr  客户端地址
+ * @param issued  签发时间
+ * @return uint32_t  返回 MAC
+ */
+uint32_t tokenMac(const sockaddr_in& addr, uint32_t issued) {
+    // 没有加载密钥文件时与 cookie 使用同一个密钥，用不同的标记区分两种用途
+    uint8_t buf[sizeof(uint32_t) * 3];
+    const uint32_t tag = 0x544f4b4e;  // "TOKN"
+    memcpy(buf, &tag, sizeof(uint32_t));
+    memcpy(buf + sizeof(uint32_t), &addr.sin_addr.s_addr, sizeof(uint32_t));
+    memcpy(buf + sizeof(uint32_t) * 2, &issued, sizeof(uint32_t));
+    return static_cast<uint32_t>(siphash24(tokenKey(), buf, sizeof(buf)));
+}
+
+/**
+ * @brief  签发会话恢复令牌
+ * @param addr  客户端地址
+ * @return ResumeToken  返回新令牌
+ */
+ResumeToken issueToken(const sockaddr_in& addr) {
+    ResumeToken token;
+    token.issued = nowSeconds();
+    token.mac = tokenMac(addr, token.issued);
+    return token;
+}
+
+/**
+ * @brief  校验会话恢复令牌
+ * @param addr  客户端地址
+ * @param token  客户端提交的令牌
+ * @return bool  令牌合法且未过期返回 true
+ */
+bool checkToken(const sockaddr_in& addr, const ResumeToken& token) {
+    uint32_t now = nowSeconds();
+    if (token.empty() || token.issued > now ||
+        now - token.issued > TOKEN_LIFETIME_SEC) {
+        return false;
+    }
+    return token.mac == tokenMac(addr, token.issued);
+}
+
+/**
+ * @brief  0-RTT 防重放缓存
+ *  记录已经交付过的 (令牌, SYN 序号)，令牌过期后对应的记录也就没用了，
+ * 缓存变大时顺便清理。多个线程各自接受连接时会同时调用，用互斥锁保护。
+ * @param token  SYN 中的令牌
+ * @param nonce  SYN 的序号，客户端每次连接随机生成
+ * @param insert  为 true 时把这次 SYN 记录下来
+ * @return bool  这次 SYN 之前已经交付过返回 true
+ */
+bool replaySeen(const ResumeToken& token, uint32_t nonce, bool insert) {
+    static std::unordered_map<uint64_t, uint32_t> seen;
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t key = (static_cast<uint64_t>(token.mac) << 32) | nonce;
+    if (seen.count(key) > 0) {
+        return true;
+    }
+    if (insert) {
+        if (seen.size() >= 65536) {
+            uint32_t now = nowSeconds();
+            std::erase_if(seen, [now](const auto& item) {
+                return now - item.second > TOKEN_LIFETIME_SEC;
+            });
+        }
+        seen[key] = token.issued;
+    }
+    return false;
+}
+
+/**
+ * @brief  服务端处理 SYN 数据包
+ *  回复携带 cookie 和新令牌的 SYN-ACK。如果 SYN 中带有合法令牌和 0-RTT 数据，
+ * 并且提供了 buffer，就把数据直接交付到 buffer 中。buffer 放不下全部数据时
+ * 拒绝 0-RTT，客户端握手后用 rudp_send_data 重新发送，数据不会被截断。
+ *  连接建立后收到的 SYN 是客户端没收到 SYN-ACK 的重传，此时 established 为
+ * true，只重新应答，不会重复交付。客户端没收到过 SYN-ACK 就不会发 ACK，
+ * 所以带合法令牌的 SYN 能遇到已建立的连接，说明连接正是由它的 0-RTT 数据建立的，
+ * 无论防重放策略如何都要告诉客户端数据已被接受，否则客户端会重新发送数据，
+ * 而服务端已经进入自己的发送流程，两端都在发送，谁也不确认。
+ * @param sockfd  socket 文件描述符
+ * @param pkt  收到的 SYN 数据包
+ * @param addr  客户端地址
+ * @param buffer  接收 0-RTT 数据的缓冲区，可以为空
+ * @param max_length  缓冲区最大长度
+ * @param established  连接是否已经建立
+ * @return ssize_t  返回交付的 0-RTT 数据长度，没有交付返回 0
+ */
+ssize_t handleSyn(int sockfd, const Packet& pkt, const sockaddr_in& addr,
+                  char* buffer, size_t max_length, bool established = false) {
+    bool accepted = false;
+    ssize_t early_length = 0;
+
+    if (pkt.data_length >= sizeof(ResumeToken) &&
+        pkt.data_length <= DATA_SIZE &&
+        rudp_replay_protection != REPLAY_DISABLED) {
+        ResumeToken token;
+        memcpy(&token, pkt.data, sizeof(token));
+        if (!checkToken(addr, token)) {
+            LOG(WARNING) << "Invalid resume token in SYN";
+        } else if (established) {
+            accepted = true;
+        } else {
+            size_t length = pkt.data_length - sizeof(ResumeToken);
+            bool deliver = buffer != nullptr;
+            if (deliver && length > max_length) {
+                // 在防重放缓存之前拒绝，否则重传的 SYN 会被当作已经交付
+                LOG(WARNING) << "0-RTT data of " << length
+                             << " bytes does not fit in buffer of " << max_length
+                             << " bytes, rejecting early data";
+                deliver = false;
+            }
+            if (rudp_replay_protection == REPLAY_CACHE &&
+                replaySeen(token, pkt.seq, deliver)) {
+                // 已经交付过，重传的 SYN 只需要再确认一次
+                accepted = true;
+                deliver = false;
+            }
+            if (deliver) {
+                early_length = length;
+                memcpy(buffer, pkt.data + sizeof(ResumeToken), early_length);
+                accepted = true;
+            }
+        }
+    }
+
+    Packet syn_ack_pkt;
+    syn_ack_pkt.type = SYN_ACK;
+    syn_ack_pkt.seq = makeCookie(addr, cookieSlot());
+    SynAckInfo info;
+    info.token = issueToken(addr);
+    info.early_accepted = accepted ? 1 : 0;
+    // 只表明意愿，服务端在收到带有共享内存信息的 ACK 之前仍然不保存任何状态
+    info.shared_memory = sharedMemoryAllowed(sockfd, addr) ? 1 : 0;
+    info.compression = compressionEnabled(sockfd) ? 1 : 0;
+    memcpy(syn_ack_pkt.data, &info, sizeof(info));
+    syn_ack_pkt.data_length = sizeof(info);
+    sendPacket(sockfd, syn_ack_pkt, addr);
+    VLOG(1) << "Sent SYN-ACK to client";
+    return early_length;
+}
+
 /*
     上面是基本的数据包发送和接收函数，下面是连接建立、数据传输和连接关闭的函数。
     服务端和客户端并不是对等的，所以上面俩可以通用，但是下面的握手和挥手都需要单独实现。
 */
 
 /**
- * @brief  服务器接受连接请求（三次握手）
- *  服务器接受连接请求，需要接收 SYN 数据包，然后发送 SYN-ACK 数据包，最后接收
- * ACK 数据包。
+ * @brief  服务器接受连接请求，并接收 0-RTT 数据（三次握手）
+ *  服务器收到 SYN 后立即回复携带 SYN cookie 的 SYN-ACK，不保存任何状态也不阻塞
+ * 等待；只有收到回显了合法 cookie 的 ACK 才认为连接建立。这样伪造源地址或迟迟
+ * 不回 ACK 的对端都无法拖住服务器。
+ *  如果 SYN 带有合法令牌和数据，则在收到 SYN 时就建立连接并交付数据，
+ * 不再等待 ACK。
+ *  开启共享内存时，本机客户端在 ACK 中带上它创建的 memfd，服务端映射成功后
+ * 这条连接的数据都通过共享内存收发。
  * @param sockfd  socket 文件描述符
  * @param client_addr  客户端地址
- * @return int  返回 0 表示连接建立成功，返回 -1 表示连接建立失败
+ * @param buffer  接收 0-RTT 数据的缓冲区
+ * @param max_length  缓冲区最大长度，0-RTT 数据超过它时拒绝 0-RTT，由客户端
+ * 在握手后重新发送
+ * @return ssize_t  返回接收的 0-RTT 数据长度，0 表示没有 0-RTT 数据，
+ * -1 表示连接建立失败
  */
-int rudp_accept(int sockfd, sockaddr_in& client_addr) {
+ssize_t rudp_accept_data(int sockfd, sockaddr_in& client_addr, char* buffer,
+                         size_t max_length) {
     Packet pkt;
+    // 文件描述符可能被新的 socket 复用，上一条连接留下的通道不能再用
+    shmUnregister(sockfd);
+    resetCompression(sockfd);
     while (true) {
         ssize_t n = recvPacket(sockfd, pkt, client_addr);
 
-        // Received SYN from client
         if (n > 0 && pkt.type == SYN) {
-            LOG(INFO) << "Received SYN from client";
-            // Send SYN-ACK
-            Packet syn_ack_pkt;
-            syn_ack_pkt.type = SYN_ACK;
-            syn_ack_pkt.seq = pkt.seq + 1;
-            sendPacket(sockfd, syn_ack_pkt, client_addr);
-            LOG(INFO) << "Sent SYN-ACK to client";
-
-            // Wait for ACK
-            n = recvPacket(sockfd, pkt, client_addr);
-            if (n > 0 && pkt.type == ACK) {
+            ssize_t early_length =
+                handleSyn(sockfd, pkt, client_addr, buffer, max_length);
+            if (early_length > 0) {
+                LOG(INFO) << "Received 0-RTT data of length " << early_length;
+                return early_length;  // Connection established
+            }
+        } else if (n > 0 && pkt.type == ACK) {
+            // 客户端在 ACK 中回显 SYN-ACK 的序号，也就是 cookie
+            if (checkCookie(client_addr, pkt.seq)) {
                 LOG(INFO) << "Received ACK from client";
+                AckInfo ack{};
+                if (pkt.data_length >= sizeof(ack)) {
+                    memcpy(&ack, pkt.data, sizeof(ack));
+                }
+                setCompressionPeer(sockfd, ack.compression != 0);
+                if (sharedMemoryAllowed(sockfd, client_addr) &&
+                    ack.offer.magic == SHM_MAGIC) {
+                    ShmChannel* channel = shmAttach(ack.offer);
+                    if (channel != nullptr) {
+                        shmRegister(sockfd, channel);
+                        LOG(INFO) << "Connection upgraded to shared memory";
+                    } else {
+                        LOG(WARNING) << "Failed to attach shared memory";
+                    }
+                }
                 return 0;  // Connection established
             }
+            LOG(WARNING) << "Invalid SYN cookie in ACK";
         } else if (n == 0) {
             // Timeout, continue waiting
             continue;
@@ -234,10 +1173,23 @@ int rudp_accept(int sockfd, sockaddr_in& client_addr) {
     return -1;  // Should not reach here
 }
 
+/**
+ * @brief  服务器接受连接请求（三次握手）
+ *  不接收 0-RTT 数据，客户端会在握手完成后重新发送。
+ * @param sockfd  socket 文件描述符
+ * @param client_addr  客户端地址
+ * @return int  返回 0 表示连接建立成功，返回 -1 表示连接建立失败
+ */
+int rudp_accept(int sockfd, sockaddr_in& client_addr) {
+    return rudp_accept_data(sockfd, client_addr, nullptr, 0) < 0 ? -1 : 0;
+}
+
 /**
  * @brief  客户端连接服务器（三次握手）
  *  客户端连接服务器，需要发送 SYN 数据包，然后接收 SYN-ACK 数据包，最后发送 ACK
  * 数据包。
+ *  两端都开启共享内存并且服务端在本机时，客户端创建 memfd 并在 ACK 中告诉
+ * 服务端，等待服务端映射后升级连接；等待超时则继续使用 UDP。
  * @param sockfd  socket 文件描述符
  * @param server_addr  服务器地址
  * @return int  返回 0 表示连接建立成功，返回 -1 表示连接建立失败
@@ -245,6 +1197,8 @@ int rudp_accept(int sockfd, sockaddr_in& client_addr) {
 int rudp_connect(int sockfd, sockaddr_in& server_addr) {
     Packet pkt;
     Packet recv_pkt;
+    shmUnregister(sockfd);
+    resetCompression(sockfd);
 
     // Send SYN
     pkt.type = SYN;
@@ -257,11 +1211,38 @@ int rudp_connect(int sockfd, sockaddr_in& server_addr) {
         ssize_t n = recvPacket(sockfd, recv_pkt, server_addr);
         if (n > 0 && recv_pkt.type == SYN_ACK) {
             LOG(INFO) << "Received SYN-ACK from server";
+            SynAckInfo info{};
+            if (recv_pkt.data_length >= sizeof(info)) {
+                memcpy(&info, recv_pkt.data, sizeof(info));
+            }
+            setCompressionPeer(sockfd, info.compression != 0);
+            ShmChannel* channel = nullptr;
+            if (info.shared_memory &&
+                sharedMemoryAllowed(sockfd, server_addr)) {
+                channel = shmCreate();
+            }
             // Send ACK
             pkt.type = ACK;
             pkt.seq = recv_pkt.seq;
+            AckInfo ack{};
+            if (channel != nullptr) {
+                ack.offer = ShmOffer{SHM_MAGIC, static_cast<uint32_t>(getpid()),
+                                     channel->fd};
+            }
+            ack.compression = compressionEnabled(sockfd) ? 1 : 0;
+            memcpy(pkt.data, &ack, sizeof(ack));
+            pkt.data_length = sizeof(ack);
             sendPacket(sockfd, pkt, server_addr);
             LOG(INFO) << "Sent ACK to server";
+            if (channel != nullptr) {
+                if (shmWaitAttached(channel, RTO_MS)) {
+                    shmRegister(sockfd, channel);
+                    LOG(INFO) << "Connection upgraded to shared memory";
+                } else {
+                    shmDestroy(channel);
+                    LOG(WARNING) << "Server did not attach shared memory";
+                }
+            }
             return 0;  // Connection established
         } else if (n == 0) {
             // Timeout, resend SYN
@@ -277,39 +1258,239 @@ int rudp_connect(int sockfd, sockaddr_in& server_addr) {
 }
 
 /**
- * @brief  发送数据
- *  发送数据时，需要等待 ACK 数据包，如果超时或者接收到错误的 ACK
- * 数据包，则重发数据。
+ * @brief  客户端连接服务器，并在 SYN 中携带数据（0-RTT）
+ *  如果持有服务端之前签发的令牌，就把令牌和数据一起放进 SYN，服务端接受后
+ * 数据在第一个数据包里就完成交付；否则退化为普通的三次握手。
+ *  无论是否接受，服务端都会在 SYN-ACK 中签发新令牌，写回 token 供下次使用。
  * @param sockfd  socket 文件描述符
+ * @param server_addr  服务器地址
  * @param data  要发送的数据
  * @param length  数据长度
+ * @param token  之前保存的令牌，返回时更新为新令牌
+ * @return ssize_t  返回服务端已经接受的数据长度，0 表示需要在握手后用
+ * rudp_send_data 重新发送，-1 表示连接建立失败
+ */
+ssize_t rudp_connect_data(int sockfd, sockaddr_in& server_addr,
+                          const char* data, size_t length,
+                          ResumeToken& token) {
+    static std::mt19937 rng(std::random_device{}());
+    Packet pkt;
+    Packet recv_pkt;
+    shmUnregister(sockfd);
+    resetCompression(sockfd);
+
+    // Send SYN, the random seq lets the server recognize retransmissions
+    pkt.type = SYN;
+    pkt.seq = rng();
+    size_t early_length = 0;
+    if (!token.empty()) {
+        const size_t max_early = DATA_SIZE - sizeof(ResumeToken);
+        early_length = (length < max_early) ? length : max_early;
+        memcpy(pkt.data, &token, sizeof(token));
+        memcpy(pkt.data + sizeof(token), data, early_length);
+        pkt.data_length = sizeof(token) + early_length;
+    }
+    sendPacket(sockfd, pkt, server_addr);
+    LOG(INFO) << "Sent SYN to server with " << early_length
+              << " bytes of 0-RTT data";
+
+    // Wait for SYN-ACK
+    while (true) {
+        ssize_t n = recvPacket(sockfd, recv_pkt, server_addr);
+        if (n > 0 && recv_pkt.type == SYN_ACK) {
+            LOG(INFO) << "Received SYN-ACK from server";
+            bool accepted = false;
+            if (recv_pkt.data_length >= sizeof(SynAckInfo)) {
+                SynAckInfo info;
+                memcpy(&info, recv_pkt.data, sizeof(info));
+                token = info.token;
+                accepted = info.early_accepted != 0 && early_length > 0;
+                setCompressionPeer(sockfd, info.compression != 0);
+            }
+            if (accepted) {
+                // 服务端在收到 SYN 时已经建立连接，不需要再发送 ACK
+                LOG(INFO) << "0-RTT data accepted by server";
+                return early_length;
+            }
+            // Send ACK
+            Packet ack_pkt;
+            ack_pkt.type = ACK;
+            ack_pkt.seq = recv_pkt.seq;
+            AckInfo ack{};
+            ack.compression = compressionEnabled(sockfd) ? 1 : 0;
+            memcpy(ack_pkt.data, &ack, sizeof(ack));
+            ack_pkt.data_length = sizeof(ack);
+            sendPacket(sockfd, ack_pkt, server_addr);
+            LOG(INFO) << "Sent ACK to server";
+            return 0;  // Connection established
+        } else if (n == 0) {
+            // Timeout, resend SYN
+            sendPacket(sockfd, pkt, server_addr);
+            LOG(WARNING) << "Timeout, resending SYN";
+            continue;
+        } else {
+            // Error or unexpected packet
+            continue;
+        }
+    }
+    return -1;  // Should not reach here
+}
+
+/**
+ * @brief  有期限的可靠性策略
+ *  ms 毫秒后放弃，重传超时取期限的四分之一，期限内大约可以重传三次。
+ * @param ms  期限（毫秒）
+ * @return DeliveryPolicy  返回可靠性策略
+ */
+DeliveryPolicy deliveryDeadline(int ms) {
+    DeliveryPolicy policy;
+    policy.deadline_ns = monotonicNs() + ms * 1000000ULL;
+    policy.rto_ms = std::clamp(ms / 4, 1, RTO_MS);
+    return policy;
+}
+
+/**
+ * @brief  限制重传次数的可靠性策略
+ * @param retransmits  最大重传次数
+ * @param rto_ms  重传超时（毫秒）
+ * @return DeliveryPolicy  返回可靠性策略
+ */
+DeliveryPolicy deliveryRetransmits(int retransmits, int rto_ms = RTO_MS) {
+    DeliveryPolicy policy;
+    policy.max_retransmits = retransmits;
+    policy.rto_ms = rto_ms;
+    return policy;
+}
+
+/**
+ * @brief  双向交替收发的连接上的可靠性策略
+ *  发送前对方可能还在重传本端已经收到的上一个数据包，策略带上接收方向的序号，
+ * 发送方只重新确认这个重复的数据包。
+ * @param expected_seq  接收方向期望的序号，策略使用期间必须有效
+ * @return DeliveryPolicy  返回可靠性策略
+ */
+DeliveryPolicy deliveryDuplex(const uint32_t& expected_seq) {
+    DeliveryPolicy policy;
+    policy.expected_seq = &expected_seq;
+    return policy;
+}
+
+/**
+ * @brief  可靠地发送一个数据包
+ *  按停等协议发送，需要等待 ACK 数据包，如果超时或者接收到错误的 ACK
+ * 数据包，则重发数据。
+ *  超过策略中的重传次数或者期限时放弃：如果这条消息还没有任何数据发出去，
+ * 直接返回；否则把数据包换成同一序号、带 FLAG_SKIP 的空数据包，可靠地发送
+ * 给接收方，让它丢弃已经收到的部分。序号只有 0/1 两个值，不能直接跳过，
+ * 跳过通知本身必须确认，两端的序号才能保持一致。
+ *  策略中带有 Pacer 时按它的节奏发送，没有重传过的数据包收到 ACK 时把 RTT
+ * 样本交给它，发送速率随测得的 RTT 调整。
+ *  等待 ACK 时收到的数据包只有在策略带有接收方向的序号、并且是已经交付过的
+ * 上一个数据包时才重新确认；其他数据包是对方的新消息，本端还没有收到，
+ * 不能确认，丢弃后等对方重传，由之后的接收调用交付。
+ *  连接已经升级为共享内存时直接写入队列，不会丢失，也不需要等待 ACK。
+ * @param sockfd  socket 文件描述符
+ * @param data_pkt  要发送的数据包，type、data 和 data_length 由调用方填好
  * @param addr      目标地址
- * @return ssize_t  返回发送的字节数
+ * @param seq_num  当前序号，收到 ACK 后切换
+ * @param policy  可靠性策略
+ * @return ssize_t  返回发送的数据长度，消息被放弃时返回 -1
  */
-ssize_t rudp_send_data(int sockfd, const char* data, size_t length,
-                       const sockaddr_in& addr, uint32_t& seq_num) {
-    Packet data_pkt;
-    data_pkt.type = DATA;
+ssize_t sendReliable(int sockfd, Packet& data_pkt, const sockaddr_in& addr,
+                     uint32_t& seq_num,
+                     const DeliveryPolicy& policy = DeliveryPolicy()) {
     data_pkt.seq = seq_num;
-    // Copy data into packet data field
-    size_t data_length = (length < DATA_SIZE) ? length : DATA_SIZE;
-    memcpy(data_pkt.data, data, data_length);
-    data_pkt.data_length = data_length;  // Set the actual length of data
-    data_pkt.checksum = 0;               // Ensure checksum is reset
+    data_pkt.checksum = 0;  // Ensure checksum is reset
+    if (ShmChannel* channel = shmChannel(sockfd)) {
+        rudp_trace_state.retransmit = false;
+        traceRecord(TRACE_SEND, data_pkt.type, data_pkt.seq,
+                    data_pkt.data_length, addr);
+        if (!shmWrite(channel, &data_pkt, HEADER_SIZE + data_pkt.data_length)) {
+            LOG(ERROR) << "Shared memory peer exited";
+            return -1;
+        }
+        seq_num = (seq_num + 1) % 2;
+        return data_pkt.data_length;
+    }
+    // 消息的第一个分片（或者普通数据包）发出之前，接收方还没有这条消息的数据
+    bool message_start = !(data_pkt.type & FLAG_FRAGMENT) ||
+                         (data_pkt.type & FLAG_FIRST);
+    bool abandoned = false;
+    int retransmits = -1;
 
     while (true) {
-        sendPacket(sockfd, data_pkt, addr);
+        int timeout_ms = policy.rto_ms;
+        if (!abandoned) {
+            uint64_t now = policy.deadline_ns ? monotonicNs() : 0;
+            bool expired =
+                (policy.max_retransmits >= 0 &&
+                 retransmits >= policy.max_retransmits) ||
+                (policy.deadline_ns && now >= policy.deadline_ns);
+            if (expired && message_start && retransmits < 0) {
+                LOG(WARNING) << "Message expired before sending";
+                return -1;
+            }
+            if (expired) {
+                LOG(WARNING) << "Abandoning message after " << retransmits
+                             << " retransmits, sending skip for seq "
+                             << seq_num;
+                abandoned = true;
+                data_pkt.type = DATA | FLAG_SKIP;
+                data_pkt.data_length = 0;
+            } else if (policy.deadline_ns) {
+                uint64_t left_ms = (policy.deadline_ns - now + 999999) / 1000000;
+                if (left_ms < static_cast<uint64_t>(timeout_ms)) {
+                    timeout_ms = left_ms;
+                }
+            }
+        }
+        // 之后的跟踪记录带上这个数据包的重传超时和是否重传，停等协议的窗口为 1
+        rudp_trace_state.rto_ms = timeout_ms;
+        rudp_trace_state.window = 1;
+        rudp_trace_state.retransmit = retransmits >= 0;
+        if (policy.pacer != nullptr) {
+            sendPacketPaced(sockfd, data_pkt, addr, *policy.pacer);
+        } else {
+            sendPacket(sockfd, data_pkt, addr);
+        }
+        uint64_t sent_ns = policy.pacer != nullptr ? monotonicNs() : 0;
+        rudp_trace_state.retransmit = false;
+        ++retransmits;
         LOG(INFO) << "Sent data packet with seq " << seq_num << " and length "
-                  << data_length;
+                  << data_pkt.data_length;
         // Wait for ACK
         Packet pkt;
-        ssize_t n = recvPacket(sockfd, pkt, const_cast<sockaddr_in&>(addr));
+        ssize_t n = recvPacket(sockfd, pkt, const_cast<sockaddr_in&>(addr),
+                               timeout_ms);
         if (n > 0 && pkt.type == DATA_ACK && pkt.seq == seq_num) {
             LOG(INFO) << "Received ACK for seq " << seq_num;
+            // 重传过的数据包分不清 ACK 对应哪一次发送，不作为 RTT 样本
+            if (policy.pacer != nullptr && retransmits == 0) {
+                pacerSampleRtt(*policy.pacer, (monotonicNs() - sent_ns) / 1e9);
+            }
             seq_num = (seq_num + 1) % 2;  // 根据停等协议，在收到 ACK 后切换序号
-            return data_length;
+            if (abandoned) {
+                return -1;
+            }
+            return data_pkt.data_length;
+        } else if (n > 0 && pkt.type == SYN) {
+            // 客户端没有收到 SYN-ACK，重新应答
+            handleSyn(sockfd, pkt, addr, nullptr, 0, true);
+            continue;
+        } else if (n > 0 && (pkt.type & TYPE_MASK) == DATA &&
+                   policy.expected_seq != nullptr &&
+                   pkt.seq == (*policy.expected_seq + 1) % 2) {
+            // 对方没有收到反方向最后一个数据包的 ACK，还在重传，重新确认，
+            // 否则双方都在重传自己的数据包，谁也等不到 ACK
+            Packet ack_pkt;
+            ack_pkt.type = DATA_ACK;
+            ack_pkt.seq = pkt.seq;
+            sendPacket(sockfd, ack_pkt, addr);
+            continue;
         } else if (n == 0) {
             // Timeout, resend data
+            traceRecord(TRACE_TIMEOUT, data_pkt.type, seq_num,
+                        data_pkt.data_length, addr);
             LOG(WARNING) << "Timeout, resending data packet";
             continue;
         } else {
@@ -322,20 +1503,50 @@ ssize_t rudp_send_data(int sockfd, const char* data, size_t length,
 }
 
 /**
- * @brief  接收数据
- *  接收数据时，需要等待数据包，然后发送 ACK 数据包。
+ * @brief  可靠地接收一个数据包
+ *  接收数据时，需要等待数据包，然后发送 ACK 数据包。数据留在 pkt 中，
+ * 由调用方直接拷贝到最终的目的地址。
+ *  共享内存连接直接从队列中读取，长度不一致的记录被丢弃。对端在本端等待数据时
+ * 关闭连接，FIN 被记录在通道上交给 rudp_wait_close 应答，返回 -1；对端进程
+ * 退出时也返回 -1。
  * @param sockfd  socket 文件描述符
- * @param buffer  接收数据的缓冲区
- * @param max_length  缓冲区最大长度
+ * @param pkt  接收到的数据包
  * @param addr      发送方地址
- * @return ssize_t  返回接收的字节数
+ * @param expected_seq  期望的序号，收到后切换
+ * @return ssize_t  返回数据包中的数据长度，共享内存连接已经关闭时返回 -1
  */
-ssize_t rudp_receive_data(int sockfd, char* buffer, size_t max_length,
-                          sockaddr_in& addr, uint32_t& expected_seq) {
+ssize_t recvReliable(int sockfd, Packet& pkt, sockaddr_in& addr,
+                     uint32_t& expected_seq) {
+    if (ShmChannel* channel = shmChannel(sockfd)) {
+        while (!channel->fin) {
+            ssize_t n = shmRead(channel, &pkt, sizeof(pkt), RTO_MS);
+            if (n == 0 && !shmPeerAlive(channel)) {
+                LOG(ERROR) << "Shared memory peer exited";
+                return -1;
+            } else if (n < HEADER_SIZE) {
+                continue;
+            }
+            if ((pkt.type & TYPE_MASK) == DATA && pkt.data_length <= DATA_SIZE &&
+                n == HEADER_SIZE + pkt.data_length) {
+                traceRecord(TRACE_RECV, pkt.type, pkt.seq, pkt.data_length,
+                            addr);
+                expected_seq = (expected_seq + 1) % 2;
+                return pkt.data_length;
+            } else if (pkt.type == FIN) {
+                traceRecord(TRACE_RECV, pkt.type, pkt.seq, 0, addr);
+                channel->fin = true;
+            } else {
+                traceRecord(TRACE_CORRUPT, pkt.type, pkt.seq, 0, addr);
+                LOG(WARNING) << "Malformed shared memory record";
+            }
+        }
+        LOG(WARNING) << "Connection closed by peer";
+        return -1;
+    }
     while (true) {
-        Packet pkt;
         ssize_t n = recvPacket(sockfd, pkt, addr);
-        if (n > 0 && pkt.type == DATA) {
+        if (n > 0 && (pkt.type & TYPE_MASK) == DATA &&
+            pkt.data_length <= DATA_SIZE) {
             if (pkt.seq == expected_seq) {
                 LOG(INFO) << "Received data packet with seq " << pkt.seq
                           << " and length " << pkt.data_length;
@@ -345,14 +1556,9 @@ ssize_t rudp_receive_data(int sockfd, char* buffer, size_t max_length,
                 ack_pkt.seq = pkt.seq;
                 sendPacket(sockfd, ack_pkt, addr);
                 LOG(INFO) << "Sent ACK for seq " << pkt.seq;
-                // Copy data to buffer
-                size_t data_length = (pkt.data_length < max_length)
-                                         ? pkt.data_length
-                                         : max_length;
-                memcpy(buffer, pkt.data, data_length);
                 expected_seq = (expected_seq + 1) %
                                2;  // Alternate expected sequence number
-                return data_length;
+                return pkt.data_length;
             } else {
                 // Send ACK for last received packet
                 Packet ack_pkt;
@@ -362,6 +1568,9 @@ ssize_t rudp_receive_data(int sockfd, char* buffer, size_t max_length,
                 LOG(WARNING) << "Unexpected seq. Expected " << expected_seq
                              << ", but got " << pkt.seq;
             }
+        } else if (n > 0 && pkt.type == SYN) {
+            // 客户端没有收到 SYN-ACK，重新应答
+            handleSyn(sockfd, pkt, addr, nullptr, 0, true);
         } else if (n == 0) {
             // Timeout, continue waiting
             continue;
@@ -373,9 +1582,301 @@ ssize_t rudp_receive_data(int sockfd, char* buffer, size_t max_length,
     return -1;  // Should not reach here
 }
 
+/**
+ * @brief  发送数据
+ *  一次最多发送 DATA_SIZE 字节，超出的部分需要调用方再次发送；
+ * 需要保留消息边界时使用 rudp_send_message。
+ * @param sockfd  socket 文件描述符
+ * @param data  要发送的数据
+ * @param length  数据长度
+ * @param addr      目标地址
+ * @param policy  可靠性策略，默认完全可靠
+ * @return ssize_t  返回发送的字节数，数据被放弃时返回 -1
+ */
+ssize_t rudp_send_data(int sockfd, const char* data, size_t length,
+                       const sockaddr_in& addr, uint32_t& seq_num,
+                       const DeliveryPolicy& policy = DeliveryPolicy()) {
+    Packet data_pkt;
+    data_pkt.type = DATA;
+    // Copy data into packet data field
+    size_t data_length = (length < DATA_SIZE) ? length : DATA_SIZE;
+    memcpy(data_pkt.data, data, data_length);
+    data_pkt.data_length = data_length;  // Set the actual length of data
+    return sendReliable(sockfd, data_pkt, addr, seq_num, policy);
+}
+
+/**
+ * @brief  接收数据
+ *  接收一个数据包，超过 max_length 的部分会被截断。发送方放弃的数据包被跳过。
+ * @param sockfd  socket 文件描述符
+ * @param buffer  接收数据的缓冲区
+ * @param max_length  缓冲区最大长度
+ * @param addr      发送方地址
+ * @return ssize_t  返回接收的字节数
+ */
+ssize_t rudp_receive_data(int sockfd, char* buffer, size_t max_length,
+                          sockaddr_in& addr, uint32_t& expected_seq) {
+    Packet pkt;
+    ssize_t n;
+    do {
+        n = recvReliable(sockfd, pkt, addr, expected_seq);
+    } while (n >= 0 && (pkt.type & FLAG_SKIP));
+    if (n < 0) {
+        return -1;
+    }
+    // Copy data to buffer
+    size_t data_length = (pkt.data_length < max_length) ? pkt.data_length
+                                                        : max_length;
+    memcpy(buffer, pkt.data, data_length);
+    return data_length;
+}
+
+/**
+ * @brief  发送一条消息
+ *  任意长度的消息被切成若干分片，每个分片都带 FLAG_FRAGMENT，第一个分片
+ * 再带 FLAG_FIRST 并在数据开头放入消息总长度，最后一个分片带 FLAG_LAST，
+ * 接收方据此恢复消息边界。
+ *  策略对整条消息生效：任何一个分片超过重传次数或者期限，剩下的分片都不再
+ * 发送，接收方收到跳过通知后丢弃已经收到的部分。
+ *  握手时协商了压缩的 UDP 连接上，超过一个数据包的消息由 CompressionPolicy
+ * 决定是否先压缩；压缩后第一个分片带 FLAG_COMPRESSED，在总长度后面再放入
+ * 原始长度。
+ * @param sockfd  socket 文件描述符
+ * @param message  要发送的消息
+ * @param addr      目标地址
+ * @param seq_num  当前序号
+ * @param policy  可靠性策略，默认完全可靠
+ * @return ssize_t  返回发送的消息长度，消息被放弃时返回 -1
+ */
+ssize_t rudp_send_message(int sockfd, std::span<const char> message,
+                          const sockaddr_in& addr, uint32_t& seq_num,
+                          const DeliveryPolicy& policy = DeliveryPolicy()) {
+    using Clock = std::chrono::steady_clock;
+    uint64_t raw = message.size();
+    MessageCompression* compression = messageCompression(sockfd);
+    bool compressed = false;
+    // 只有一个数据包的消息压缩后数据包数不变，共享内存连接没有线上开销，都不压缩
+    if (compression != nullptr && compression->peer &&
+        shmChannel(sockfd) == nullptr && raw > DATA_SIZE &&
+        shouldCompress(compression->policy)) {
+        auto begin = Clock::now();
+        compression->buffer.resize(raw);
+        size_t packed = lzCompress(
+            reinterpret_cast<const uint8_t*>(message.data()), raw,
+            reinterpret_cast<uint8_t*>(compression->buffer.data()), raw);
+        recordCompress(compression->policy, raw, packed,
+                       std::chrono::duration<double, std::nano>(Clock::now() -
+                                                                begin)
+                           .count());
+        if (packed > 0) {
+            message = std::span<const char>(compression->buffer.data(), packed);
+            compressed = true;
+        }
+    }
+
+    auto begin = Clock::now();
+    uint64_t total = message.size();
+    size_t offset = 0;
+    Packet pkt;
+    do {
+        pkt.type = DATA | FLAG_FRAGMENT;
+        size_t header = 0;
+        if (offset == 0) {
+            pkt.type |= FLAG_FIRST;
+            memcpy(pkt.data, &total, sizeof(total));
+            header = sizeof(total);
+            if (compressed) {
+                pkt.type |= FLAG_COMPRESSED;
+                memcpy(pkt.data + header, &raw, sizeof(raw));
+                header += sizeof(raw);
+            }
+        }
+        size_t remaining = total - offset;
+        size_t length = (remaining < DATA_SIZE - header) ? remaining
+                                                         : DATA_SIZE - header;
+        memcpy(pkt.data + header, message.data() + offset, length);
+        pkt.data_length = header + length;
+        offset += length;
+        if (offset == total) {
+            pkt.type |= FLAG_LAST;
+        }
+        if (sendReliable(sockfd, pkt, addr, seq_num, policy) < 0) {
+            return -1;
+        }
+    } while (offset < total);
+    if (compression != nullptr && compression->peer && total > 0) {
+        recordSend(compression->policy, total,
+                   std::chrono::duration<double, std::nano>(Clock::now() -
+                                                            begin)
+                       .count());
+    }
+    return raw;
+}
+
+/**
+ * @brief  接收并重组一条消息
+ *  第一个分片到达时调用 reserve(总长度) 取得目的缓冲区，之后每个分片直接拷贝
+ * 到缓冲区中的对应位置。对非空消息 reserve 返回空指针表示放不下，此时丢弃
+ * 数据但继续接收到最后一个分片。收到跳过通知时丢弃未收完的消息，继续等待
+ * 下一条消息。未收完的消息被新消息的第一个分片或者普通数据包打断时，
+ * 记录警告并丢弃未收完的部分。
+ *  带 FLAG_COMPRESSED 的消息用原始长度调用 reserve，压缩数据先收到临时缓冲区，
+ * 收齐后解压到目的缓冲区，解压后的长度必须正好是原始长度。
+ * @param sockfd  socket 文件描述符
+ * @param addr      发送方地址
+ * @param expected_seq  期望的序号
+ * @param reserve  根据消息总长度返回目的缓冲区
+ * @return ssize_t  返回消息长度，放不下或者解压失败时返回 -1
+ */
+template <typename Reserve>
+ssize_t recvMessage(int sockfd, sockaddr_in& addr, uint32_t& expected_seq,
+                    Reserve reserve) {
+    Packet pkt;
+    char* dest = nullptr;
+    uint64_t total = 0;  // 线上的长度，压缩时是压缩后的长度
+    uint64_t offset = 0;
+    bool started = false;
+    bool compressed = false;   // 当前消息经过压缩
+    uint64_t raw = 0;          // 消息的原始长度
+    char* output = nullptr;    // 压缩消息解压的目的缓冲区
+    std::vector<char> packed;  // 压缩消息的数据
+    while (true) {
+        if (recvReliable(sockfd, pkt, addr, expected_seq) < 0) {
+            return -1;
+        }
+        uint32_t flags = pkt.type & ~TYPE_MASK;
+        size_t header = 0;
+        if (flags & FLAG_SKIP) {
+            if (started) {
+                LOG(WARNING) << "Message abandoned by sender after " << offset
+                             << " of " << total << " bytes";
+            }
+            started = false;
+            continue;
+        } else if (flags == 0) {
+            // 普通数据包，本身就是一条完整的消息
+            if (started) {
+                LOG(WARNING) << "Plain packet interrupted message, discarded "
+                             << offset << " of " << total << " bytes";
+            }
+            total = pkt.data_length;
+            raw = total;
+            compressed = false;
+            dest = reserve(total);
+            offset = 0;
+        } else if (flags & FLAG_FIRST) {
+            if (started) {
+                LOG(WARNING) << "Message restarted before last fragment, "
+                             << "discarded " << offset << " of " << total
+                             << " bytes";
+            }
+            if (pkt.data_length < sizeof(total)) {
+                LOG(WARNING) << "Malformed first fragment";
+                continue;
+            }
+            memcpy(&total, pkt.data, sizeof(total));
+            header = sizeof(total);
+            raw = total;
+            compressed = flags & FLAG_COMPRESSED;
+            if (compressed) {
+                if (pkt.data_length < sizeof(total) + sizeof(raw)) {
+                    LOG(WARNING) << "Malformed first fragment";
+                    continue;
+                }
+                memcpy(&raw, pkt.data + header, sizeof(raw));
+                header += sizeof(raw);
+                // 压缩后不会比原始数据长
+                output = raw <= MAX_MESSAGE_SIZE && total <= raw ? reserve(raw)
+                                                                 : nullptr;
+                if (output != nullptr) {
+                    packed.resize(total);
+                }
+                dest = output != nullptr ? packed.data() : nullptr;
+            } else {
+                dest = total <= MAX_MESSAGE_SIZE ? reserve(total) : nullptr;
+            }
+            offset = 0;
+            started = true;
+        } else if (!started) {
+            LOG(WARNING) << "Dropped fragment without message start";
+            continue;
+        }
+
+        size_t length = pkt.data_length - header;
+        if (offset + length > total) {
+            LOG(WARNING) << "Fragment exceeds message length";
+            length = total - offset;
+        }
+        if (dest != nullptr) {
+            memcpy(dest + offset, pkt.data + header, length);
+        }
+        offset += length;
+
+        if (flags == 0 || (flags & FLAG_LAST)) {
+            if (dest == nullptr && total > 0) {
+                LOG(ERROR) << "Message of length " << raw
+                           << " does not fit in buffer";
+                return -1;
+            }
+            if (compressed &&
+                lzDecompress(reinterpret_cast<const uint8_t*>(dest), total,
+                             reinterpret_cast<uint8_t*>(output), raw) !=
+                    static_cast<ssize_t>(raw)) {
+                LOG(ERROR) << "Corrupt compressed message";
+                return -1;
+            }
+            return raw;
+        }
+    }
+}
+
+/**
+ * @brief  接收一条消息，重组到调用方提供的缓冲区
+ *  每个分片的数据从数据包直接拷贝到 buffer 中的对应位置，不经过中间缓冲。
+ * 消息比 buffer 长时仍然会把剩余分片收完，保证下一条消息的边界正确。
+ * 没有分片标志的数据包（rudp_send_data 发送的）当作一条完整的消息。
+ * @param sockfd  socket 文件描述符
+ * @param buffer  接收消息的缓冲区
+ * @param addr      发送方地址
+ * @param expected_seq  期望的序号
+ * @return ssize_t  返回消息长度，消息放不下时返回 -1
+ */
+ssize_t rudp_recv_message(int sockfd, std::span<char> buffer,
+                          sockaddr_in& addr, uint32_t& expected_seq) {
+    return recvMessage(sockfd, addr, expected_seq, [&](uint64_t total) {
+        return total <= buffer.size() ? buffer.data() : nullptr;
+    });
+}
+
+/**
+ * @brief  接收一条消息，重组到可复用的 vector 中
+ *  vector 根据第一个分片中的消息总长度一次性调整大小，反复使用同一个 vector
+ * 时已有的容量会被复用，不会每条消息都重新分配内存。总长度来自对端，
+ * 超过 max_length 的消息不分配内存，收完剩余分片后返回 -1。
+ * @param sockfd  socket 文件描述符
+ * @param message  接收消息的 vector
+ * @param addr      发送方地址
+ * @param expected_seq  期望的序号
+ * @param max_length  接受的最大消息长度，不超过 MAX_MESSAGE_SIZE
+ * @return ssize_t  返回消息长度，消息超过 max_length 时返回 -1
+ */
+ssize_t rudp_recv_message(int sockfd, std::vector<char>& message,
+                          sockaddr_in& addr, uint32_t& expected_seq,
+                          uint64_t max_length = MAX_MESSAGE_SIZE) {
+    return recvMessage(sockfd, addr, expected_seq, [&](uint64_t total) {
+        if (total > max_length) {
+            return static_cast<char*>(nullptr);
+        }
+        message.resize(total);
+        return message.data();
+    });
+}
+
 /**
  * @brief 关闭连接（四次挥手）
  *  关闭连接时，需要发送 FIN 数据包，然后等待 FIN-ACK 数据包。
+ * 共享内存连接在队列中交换 FIN 和 FIN-ACK，然后释放共享内存；等待时对端进程
+ * 已经退出则直接释放并返回 -1。
  * @param sockfd  socket 文件描述符
  * @param addr  目标地址
  * @return int  返回 0 表示连接关闭成功，返回 -1 表示连接关闭失败
@@ -384,6 +1885,30 @@ int rudp_close_connection(int sockfd, sockaddr_in& addr) {
     // Send FIN
     Packet fin_pkt;
     fin_pkt.type = FIN;
+    if (ShmChannel* channel = shmChannel(sockfd)) {
+        // 对端同时关闭时也会发来 FIN，应答后继续等待 FIN-ACK
+        bool ok = shmWrite(channel, &fin_pkt, HEADER_SIZE);
+        Packet pkt;
+        while (ok) {
+            ssize_t n = shmRead(channel, &pkt, sizeof(pkt), RTO_MS);
+            if (n >= HEADER_SIZE && pkt.type == FIN_ACK) {
+                break;
+            } else if (n >= HEADER_SIZE && pkt.type == FIN) {
+                Packet fin_ack_pkt;
+                fin_ack_pkt.type = FIN_ACK;
+                ok = shmWrite(channel, &fin_ack_pkt, HEADER_SIZE);
+            } else if (n == 0) {
+                ok = shmPeerAlive(channel);
+            }
+        }
+        shmUnregister(sockfd);
+        if (!ok) {
+            LOG(WARNING) << "Shared memory peer exited before FIN-ACK";
+            return -1;
+        }
+        LOG(INFO) << "Closed shared memory connection";
+        return 0;
+    }
     sendPacket(sockfd, fin_pkt, addr);
     LOG(INFO) << "Sent FIN";
 
@@ -410,11 +1935,36 @@ int rudp_close_connection(int sockfd, sockaddr_in& addr) {
 /**
  * @brief  等待关闭连接（四次挥手）
  *  等待关闭连接时，需要等待 FIN 数据包，然后发送 FIN-ACK 数据包。
+ * 共享内存连接在队列中交换 FIN 和 FIN-ACK，然后释放共享内存；等待时对端进程
+ * 已经退出则直接释放并返回 -1。
  * @param sockfd  socket 文件描述符
  * @param addr  发送方地址
  * @return int  返回 0 表示连接关闭成功，返回 -1 表示连接关闭失败
  */
 int rudp_wait_close(int sockfd, sockaddr_in& addr) {
+    if (ShmChannel* channel = shmChannel(sockfd)) {
+        // recvReliable 可能已经读到了 FIN
+        bool ok = true;
+        Packet pkt;
+        while (ok && !channel->fin) {
+            ssize_t n = shmRead(channel, &pkt, sizeof(pkt), RTO_MS);
+            if (n >= HEADER_SIZE && pkt.type == FIN) {
+                channel->fin = true;
+            } else if (n == 0) {
+                ok = shmPeerAlive(channel);
+            }
+        }
+        Packet fin_ack_pkt;
+        fin_ack_pkt.type = FIN_ACK;
+        ok = ok && shmWrite(channel, &fin_ack_pkt, HEADER_SIZE);
+        shmUnregister(sockfd);
+        if (!ok) {
+            LOG(WARNING) << "Shared memory peer exited before FIN";
+            return -1;
+        }
+        LOG(INFO) << "Closed shared memory connection";
+        return 0;
+    }
     while (true) {
         Packet pkt;
         ssize_t n = recvPacket(sockfd, pkt, addr);
@@ -46,11 +46,20 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    // 令牌密钥保存在当前目录，服务端重启后客户端保存的令牌仍然可以用于 0-RTT
+    if (rudp_load_token_key(".rudp_token_key") < 0) {
+        LOG(WARNING) << "Failed to load token key, tokens will not survive "
+                        "a restart";
+    }
+
     // 等待连接
     LOG(INFO) << "Server listening on port " << port;
 
-    // 建立连接（三次握手）
-    if (rudp_accept(sockfd, client_addr) == 0) {
+    // 建立连接（三次握手），客户端持有令牌时数据会随 SYN 一起到达
+    char buffer[DATA_SIZE];
+    ssize_t received_bytes =
+        rudp_accept_data(sockfd, client_addr, buffer, DATA_SIZE);
+    if (received_bytes >= 0) {
         LOG(INFO) << "Connection established with client";
     } else {
         LOG(ERROR) << "Failed to establish connection";
@@ -59,10 +68,11 @@ int main(int argc, char* argv[]) {
     }
 
     // 从客户端接收数据（例如，“Hello”消息）
-    char buffer[DATA_SIZE];
     uint32_t expected_seq = 0;
-    ssize_t received_bytes =
-        rudp_receive_data(sockfd, buffer, DATA_SIZE, client_addr, expected_seq);
+    if (received_bytes == 0) {
+        received_bytes = rudp_receive_data(sockfd, buffer, DATA_SIZE,
+                                           client_addr, expected_seq);
+    }
     if (received_bytes > 0) {
         LOG(INFO) << "Received data from client: " << buffer;
     } else {
@@ -73,8 +83,10 @@ int main(int argc, char* argv[]) {
     // 向客户端发送数据（例如，“Hello”消息）
     const char* message = "Hello from Server";
     uint32_t seq_num = 0;
-    ssize_t sent_bytes = rudp_send_data(sockfd, message, strlen(message) + 1,
-                                        client_addr, seq_num);
+    // 客户端可能没有收到上面的 ACK，还在重传它的消息，发送时要重新确认
+    ssize_t sent_bytes =
+        rudp_send_data(sockfd, message, strlen(message) + 1, client_addr,
+                       seq_num, deliveryDuplex(expected_seq));
     if (sent_bytes > 0) {
         LOG(INFO) << "Sent data to client: " << message;
     } else {
@@ -1,7 +1,5 @@
 // server.cpp
-#include <fstream>
-
-#include "rudp.h"
+#include "transfer.h"
 
 // 这是服务端的实现，为了方便，这里没有考虑多客户机的情况。
 // 如果要使用多客户机，可以添加pthread
@@ -18,6 +16,11 @@ int main(int argc, char* argv[]) {
     FLAGS_colorlogtostdout = true;  // 设置输出到标准输出的日志显示相应颜色
     FLAGS_v = 2;                    // 设置详细级别
 
+    // 设置了 RUDP_TRACE_DIR 时记录二进制数据包跟踪，用 trace-tool 分析
+    if (rudp_trace_from_env() < 0) {
+        LOG(WARNING) << "Failed to create trace directory";
+    }
+
     if (argc != 3) {
         LOG(ERROR) << "Usage: " << process_name << " <port> <filename>";
         return -1;
@@ -60,85 +63,36 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    // 从客户端接收文件
-    std::ofstream outfile("received_from_client_" + filename, std::ios::binary);
-    if (!outfile) {
-        LOG(ERROR) << "Failed to create output file";
+    // 从客户端接收文件，上次中断时已经收到的部分会保留下来
+    std::vector<Stream> streams(1);
+    streams[0].sockfd = sockfd;
+    streams[0].addr = client_addr;
+    std::string outname = "received_from_client_" + filename;
+    TransferStats stats;
+    if (receiveFiles(
+            streams, [&](const FileEntry&) { return outname; }, stats) < 0) {
+        LOG(ERROR) << "Failed to receive file from client";
+        rudp_close_connection(sockfd, streams[0].addr);
         close(sockfd);
         return -1;
     }
+    LOG(INFO) << "File received from client, " << stats.bytes
+              << " bytes received, " << stats.skipped
+              << " bytes already present";
 
-    char buffer[DATA_SIZE];
-    ssize_t received_bytes;
-    uint32_t expected_seq = 0;
-    while (true) {
-        received_bytes = rudp_receive_data(sockfd, buffer, DATA_SIZE,
-                                           client_addr, expected_seq);
-        if (received_bytes > 0) {
-            // 写入接收到的数据到文件
-            outfile.write(buffer, received_bytes);
-            LOG(INFO) << "Received data chunk of size " << received_bytes;
-            if (received_bytes < DATA_SIZE) {
-                // 可能是最后一个数据包
-                LOG(INFO) << "Received the last data chunk";
-                break;
-            }
-        } else if (received_bytes == 0) {
-            // 数据接收完成
-            break;
-        } else {
-            LOG(ERROR) << "Failed to receive data from client";
-            // 处理错误或退出
-            break;
-        }
-    }
-
-    outfile.close();
-    LOG(INFO) << "File received from client";
-
-    // 向客户端发送文件
-    std::ifstream infile(filename, std::ios::binary);
-    if (!infile) {
-        LOG(ERROR) << "Failed to open file " << filename;
+    // 向客户端发送文件，客户端上已经有的块会被跳过
+    if (sendFiles(streams, filename, stats) < 0) {
+        LOG(ERROR) << "Failed to send file " << filename;
         // 可以选择通知客户端失败
-        rudp_close_connection(sockfd, client_addr);
+        rudp_close_connection(sockfd, streams[0].addr);
         close(sockfd);
         return -1;
     }
-
-    ssize_t sent_bytes;
-    uint32_t seq_num = 0;
-    while (infile.read(buffer, DATA_SIZE)) {
-        std::streamsize bytes_read = infile.gcount();
-        sent_bytes =
-            rudp_send_data(sockfd, buffer, bytes_read, client_addr, seq_num);
-        if (sent_bytes > 0) {
-            LOG(INFO) << "Sent data chunk of size " << sent_bytes;
-        } else {
-            LOG(ERROR) << "Failed to send data to client";
-            // 处理错误或退出
-            break;
-        }
-    }
-    // 处理可能的最后一部分数据
-    if (infile.eof()) {
-        std::streamsize bytes_read = infile.gcount();
-        if (bytes_read > 0) {
-            sent_bytes = rudp_send_data(sockfd, buffer, bytes_read, client_addr,
-                                        seq_num);
-            if (sent_bytes > 0) {
-                LOG(INFO) << "Sent final data chunk of size " << sent_bytes;
-            } else {
-                LOG(ERROR) << "Failed to send final data to client";
-            }
-        }
-    }
-
-    infile.close();
-    LOG(INFO) << "File sent to client";
+    LOG(INFO) << "File sent to client, " << stats.bytes << " bytes sent, "
+              << stats.skipped << " bytes already present";
 
     // 关闭连接（四次挥手）
-    if (rudp_close_connection(sockfd, client_addr) == 0) {
+    if (rudp_close_connection(sockfd, streams[0].addr) == 0) {
         LOG(INFO) << "Connection closed";
     } else {
         LOG(ERROR) << "Failed to close connection properly";
@@ -0,0 +1,368 @@
+// shm.h
+#ifndef SHM_H
+#define SHM_H
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// 本机对端的共享内存通道：一块 memfd 共享内存中放两个单生产者单消费者的环形
+// 队列，每个方向一个。数据包直接拷贝进对端可见的内存，不经过内核 UDP 协议栈，
+// 也不需要校验和。队列空或者满时用 futex 睡眠等待，另一端写入或者读出后唤醒。
+//
+// memfd 由客户端创建，服务端通过 /proc/<pid>/fd/<fd> 打开同一个文件，
+// 要求两个进程属于同一用户。eventfd 不能通过 /proc 重新打开，所以用 futex 唤醒。
+//
+// 共享内存中记录两端的进程号，每端用 pidfd 监视对端。等待超时时检查对端
+// 是否已经退出，对端崩溃后读写会失败返回，而不是一直等在没有人的队列上。
+
+const uint32_t SHM_MAGIC = 0x52554450;  // "RUDP"
+const uint32_t SHM_SLOTS = 1024;        // 每个方向的槽位数，必须是 2 的幂
+const uint32_t SHM_SLOT_SIZE = 1024;    // 每个槽位最多放的字节数
+const int SHM_SPIN = 200;               // 睡眠之前自旋检查的次数
+
+// 共享内存的状态，由客户端初始化为 SHM_WAITING，两端用 CAS 决定结果
+enum ShmState : uint32_t {
+    SHM_WAITING,    // 客户端等待服务端映射
+    SHM_ATTACHED,   // 服务端已经映射，连接升级成功
+    SHM_ABANDONED,  // 客户端等待超时，双方都继续使用 UDP
+    SHM_ATTACHING,  // 服务端已经占用，正在写入进程号
+};
+
+/**
+ * @brief  一个槽位
+ */
+struct ShmSlot {
+    uint32_t length;
+    char data[SHM_SLOT_SIZE];
+};
+
+/**
+ * @brief  单生产者单消费者环形队列
+ *  head 只由消费者写，tail 只由生产者写，两者都只增不减，取模后得到槽位。
+ * 等待的一方先设置 waiting 标志再检查一次计数，另一端更新计数后看到标志就唤醒，
+ * 两边都用顺序一致的原子操作，不会丢失唤醒。
+ */
+struct ShmRing {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    alignas(64) std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> producer_waiting;
+    alignas(64) ShmSlot slots[SHM_SLOTS];
+};
+
+/**
+ * @brief  共享内存的布局
+ *  rings[0] 是客户端到服务端，rings[1] 是服务端到客户端。
+ */
+struct ShmRegion {
+    uint32_t magic;
+    std::atomic<uint32_t> state;
+    uint32_t pids[2];  // 客户端和服务端的进程号
+    ShmRing rings[2];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "shared memory atomics must be lock free");
+
+/**
+ * @brief  一条升级后的连接
+ */
+struct ShmChannel {
+    int fd;              // memfd
+    ShmRegion* region;   // 映射后的共享内存
+    ShmRing* tx;         // 本端写入的队列
+    ShmRing* rx;         // 本端读取的队列
+    uint32_t peer_pid;   // 对端进程号
+    int peer;            // 对端进程的 pidfd，内核不支持时为 -1
+    bool fin;            // 接收数据时已经收到了对端的 FIN
+};
+
+/**
+ * @brief  客户端在 ACK 中告诉服务端如何打开共享内存
+ */
+struct ShmOffer {
+    uint32_t magic;
+    uint32_t pid;
+    int32_t fd;
+};
+
+/**
+ * @brief  单调时钟的当前时间（毫秒）
+ */
+uint64_t shmNowMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief  在 futex 上等待，直到 *word 不等于 expected、被唤醒或者超时
+ */
+void futexWait(std::atomic<uint32_t>* word, uint32_t expected, int timeout_ms) {
+    timespec timeout{timeout_ms / 1000, timeout_ms % 1000 * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+            &timeout, nullptr, 0);
+}
+
+/**
+ * @brief  唤醒在 futex 上等待的所有线程（包括其他进程中的）
+ */
+void futexWake(std::atomic<uint32_t>* word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX,
+            nullptr, nullptr, 0);
+}
+
+/**
+ * @brief  映射 memfd 并检查大小
+ * @return ShmChannel*  返回通道，失败返回空指针
+ */
+ShmChannel* shmMap(int fd, bool client) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != sizeof(ShmRegion)) {
+        close(fd);
+        return nullptr;
+    }
+    void* map = mmap(nullptr, sizeof(ShmRegion), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    ShmRegion* region = static_cast<ShmRegion*>(map);
+    ShmChannel* channel = new ShmChannel;
+    channel->fd = fd;
+    channel->region = region;
+    channel->tx = &region->rings[client ? 0 : 1];
+    channel->rx = &region->rings[client ? 1 : 0];
+    channel->peer_pid = 0;
+    channel->peer = -1;
+    channel->fin = false;
+    return channel;
+}
+
+/**
+ * @brief  开始监视对端进程
+ *  优先使用 pidfd，进程号被复用也不会误判；内核不支持时退回到按进程号检查。
+ */
+void shmWatchPeer(ShmChannel* channel, uint32_t pid) {
+    channel->peer_pid = pid;
+#ifdef SYS_pidfd_open
+    channel->peer = syscall(SYS_pidfd_open, pid, 0);
+#endif
+}
+
+/**
+ * @brief  对端进程是否还在运行
+ *  pidfd 在进程退出后变为可读。
+ */
+bool shmPeerAlive(const ShmChannel* channel) {
+    if (channel->peer >= 0) {
+        pollfd pfd{channel->peer, POLLIN, 0};
+        return poll(&pfd, 1, 0) == 0;
+    }
+    return channel->peer_pid == 0 || kill(channel->peer_pid, 0) == 0 ||
+           errno != ESRCH;
+}
+
+/**
+ * @brief  客户端创建共享内存
+ *  memfd 的内容初始为 0，计数和等待标志都不需要再初始化。
+ * @return ShmChannel*  返回通道，失败返回空指针
+ */
+ShmChannel* shmCreate() {
+    int fd = memfd_create("rudp", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, sizeof(ShmRegion)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    ShmChannel* channel = shmMap(fd, true);
+    if (channel != nullptr) {
+        channel->region->magic = SHM_MAGIC;
+        channel->region->pids[0] = getpid();
+        channel->region->state.store(SHM_WAITING);
+    }
+    return channel;
+}
+
+/**
+ * @brief  服务端打开客户端创建的共享内存
+ *  offer 来自没有认证的 ACK，文件可能不是客户端的共享内存：只打开大小正确的
+ * 普通文件，映射后检查魔数，用 CAS 把状态从 SHM_WAITING 改为 SHM_ATTACHING
+ * 占用之后才写入，写完进程号再改为 SHM_ATTACHED。客户端已经放弃时失败。
+ * @param offer  客户端在 ACK 中发来的信息
+ * @return ShmChannel*  返回通道，失败返回空指针
+ */
+ShmChannel* shmAttach(const ShmOffer& offer) {
+    std::string path = "/proc/" + std::to_string(offer.pid) + "/fd/" +
+                       std::to_string(offer.fd);
+    // 打开设备或者管道可能有副作用，打开之前先确认是大小正确的普通文件
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size != sizeof(ShmRegion)) {
+        return nullptr;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    ShmChannel* channel = shmMap(fd, false);
+    if (channel == nullptr) {
+        return nullptr;
+    }
+    ShmRegion* region = channel->region;
+    uint32_t expected = SHM_WAITING;
+    bool claimed = region->magic == SHM_MAGIC &&
+                   region->state.compare_exchange_strong(expected, SHM_ATTACHING);
+    if (claimed) {
+        // 客户端看到 SHM_ATTACHED 时一定能读到进程号；客户端在这期间超时
+        // 会把状态改为 SHM_ABANDONED，下面的 CAS 失败
+        region->pids[1] = getpid();
+        expected = SHM_ATTACHING;
+        claimed = region->state.compare_exchange_strong(expected, SHM_ATTACHED);
+    }
+    if (!claimed) {
+        munmap(region, sizeof(ShmRegion));
+        close(channel->fd);
+        delete channel;
+        return nullptr;
+    }
+    futexWake(&region->state);
+    shmWatchPeer(channel, offer.pid);
+    return channel;
+}
+
+/**
+ * @brief  客户端等待服务端映射
+ *  超时后把状态改为 SHM_ABANDONED，服务端正在映射（SHM_ATTACHING）时也放弃，
+ * 服务端随后的 CAS 会失败；如果服务端恰好先完成映射，以服务端为准。
+ * @return bool  服务端映射成功返回 true
+ */
+bool shmWaitAttached(ShmChannel* channel, int timeout_ms) {
+    std::atomic<uint32_t>& state = channel->region->state;
+    uint64_t deadline = shmNowMs() + timeout_ms;
+    while (true) {
+        uint32_t current = state.load();
+        if (current == SHM_ATTACHED) {
+            break;
+        } else if (current == SHM_ABANDONED) {
+            return false;
+        }
+        uint64_t now = shmNowMs();
+        if (now < deadline) {
+            futexWait(&state, current, deadline - now);
+        } else if (state.compare_exchange_strong(current, SHM_ABANDONED)) {
+            return false;
+        }
+    }
+    shmWatchPeer(channel, channel->region->pids[1]);
+    return true;
+}
+
+/**
+ * @brief  释放通道
+ */
+void shmDestroy(ShmChannel* channel) {
+    munmap(channel->region, sizeof(ShmRegion));
+    close(channel->fd);
+    if (channel->peer >= 0) {
+        close(channel->peer);
+    }
+    delete channel;
+}
+
+/**
+ * @brief  写入一条记录，队列满时等待消费者
+ * @param channel  通道，写入本端的发送队列
+ * @param data  数据
+ * @param length  数据长度，不超过 SHM_SLOT_SIZE
+ * @return bool  返回 true 表示写入成功，记录太长或者等待时对端已经退出返回 false
+ */
+bool shmWrite(ShmChannel* channel, const void* data, uint32_t length) {
+    if (length > SHM_SLOT_SIZE) {
+        return false;
+    }
+    ShmRing* ring = channel->tx;
+    uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+    int spins = 0;
+    while (tail - ring->head.load(std::memory_order_acquire) == SHM_SLOTS) {
+        if (++spins < SHM_SPIN) {
+            continue;
+        }
+        uint32_t head = ring->head.load();
+        ring->producer_waiting.store(1);
+        if (tail - ring->head.load() == SHM_SLOTS) {
+            futexWait(&ring->head, head, 1000);
+        }
+        ring->producer_waiting.store(0);
+        if (ring->head.load() == head && !shmPeerAlive(channel)) {
+            return false;
+        }
+    }
+    ShmSlot& slot = ring->slots[tail & (SHM_SLOTS - 1)];
+    slot.length = length;
+    memcpy(slot.data, data, length);
+    ring->tail.store(tail + 1);
+    if (ring->consumer_waiting.load()) {
+        futexWake(&ring->tail);
+    }
+    return true;
+}
+
+/**
+ * @brief  读取一条记录，队列空时等待生产者
+ *  记录长度由对端写入，超过槽位或者缓冲区大小时丢弃这条记录并返回 -1。
+ * 超时后调用方可以用 shmPeerAlive 判断对端是否已经退出。
+ * @param channel  通道，读取本端的接收队列
+ * @param data  接收数据的缓冲区
+ * @param capacity  缓冲区大小
+ * @param timeout_ms  超时时间（毫秒）
+ * @return ssize_t  返回记录长度，超时返回 0，记录长度非法返回 -1
+ */
+ssize_t shmRead(ShmChannel* channel, void* data, size_t capacity,
+                int timeout_ms) {
+    ShmRing* ring = channel->rx;
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    int spins = 0;
+    while (ring->tail.load(std::memory_order_acquire) == head) {
+        if (++spins < SHM_SPIN) {
+            continue;
+        }
+        uint32_t tail = ring->tail.load();
+        ring->consumer_waiting.store(1);
+        if (ring->tail.load() == head) {
+            futexWait(&ring->tail, tail, timeout_ms);
+        }
+        ring->consumer_waiting.store(0);
+        if (ring->tail.load() == head) {
+            return 0;
+        }
+    }
+    const ShmSlot& slot = ring->slots[head & (SHM_SLOTS - 1)];
+    uint32_t length = slot.length;
+    bool valid = length <= SHM_SLOT_SIZE && length <= capacity;
+    if (valid) {
+        memcpy(data, slot.data, length);
+    }
+    ring->head.store(head + 1);
+    if (ring->producer_waiting.load()) {
+        futexWake(&ring->head);
+    }
+    return valid ? static_cast<ssize_t>(length) : -1;
+}
+
+#endif  // SHM_H
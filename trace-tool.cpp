@@ -0,0 +1,501 @@
+// trace-tool.cpp
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "impair.h"
+
+// 跟踪文件分析工具：读取 rudp-trace.* 缓冲区文件或者 rudp_trace_dump 的输出，
+// 打印记录、按线程汇总、画时间-序列图，或者经过丢包中继重放一次传输。
+// 使用 ./trace-tool <command> [args] 的形式运行，不带参数时打印可用的命令。
+
+// 重放时短于这个时间的空闲是协议本身的处理时间，不是发送方的停顿，不等待
+const uint64_t REPLAY_MIN_WAIT_NS = 100000;
+
+/**
+ * @brief  读取多个跟踪文件，按时间合并
+ * @return int  返回 0 表示成功，任何一个文件读取失败返回 -1
+ */
+static int loadTraces(int argc, char* argv[], std::vector<TraceRecord>& records) {
+    for (int i = 0; i < argc; ++i) {
+        if (traceRead(argv[i], records) < 0) {
+            LOG(ERROR) << "Invalid trace file: " << argv[i];
+            return -1;
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) {
+                         return a.time_ns < b.time_ns;
+                     });
+    return 0;
+}
+
+static const char* typeName(uint32_t type) {
+    static const char* names[] = {"?",        "SYN", "SYN_ACK", "ACK",
+                                  "DATA",     "DATA_ACK", "FIN", "FIN_ACK"};
+    type &= TYPE_MASK;
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : "?";
+}
+
+static const char* eventName(uint8_t event) {
+    static const char* names[] = {"send", "recv", "timeout", "corrupt"};
+    return event < sizeof(names) / sizeof(names[0]) ? names[event] : "?";
+}
+
+static bool isData(const TraceRecord& r) {
+    return (r.type & TYPE_MASK) == DATA;
+}
+
+static bool isDataAck(const TraceRecord& r) {
+    return (r.type & TYPE_MASK) == DATA_ACK;
+}
+
+static int printRecords(int argc, char* argv[]) {
+    std::vector<TraceRecord> records;
+    if (loadTraces(argc, argv, records) < 0) {
+        return -1;
+    }
+    uint64_t start = records.empty() ? 0 : records.front().time_ns;
+    for (const TraceRecord& r : records) {
+        printf("%12.3fms tid=%-6u port=%-5u %-7s %-8s seq=%u len=%-4u rto=%u "
+               "win=%u cwnd=%u%s%s%s%s\n",
+               (r.time_ns - start) / 1e6, r.thread, r.port, eventName(r.event),
+               typeName(r.type), r.seq, r.length, r.rto_ms, r.window, r.cwnd,
+               r.retransmit ? " retransmit" : "",
+               r.type & FLAG_FIRST ? " first" : "",
+               r.type & FLAG_LAST ? " last" : "",
+               r.type & FLAG_SKIP ? " skip" : "");
+    }
+    return 0;
+}
+
+/**
+ * @brief  一个线程的统计
+ *  停等协议中一个线程就是一个方向的发送方或者接收方，按线程汇总就能区分
+ * 丢包（超时和重传）、重传超时的退避（rto 变大）和停顿（两次事件之间的空闲）。
+ */
+struct FlowStats {
+    uint32_t thread = 0;
+    uint16_t port = 0;
+    uint64_t first_ns = 0;
+    uint64_t last_ns = 0;
+    size_t data_sent = 0;       // 首次发送的数据包
+    size_t retransmits = 0;     // 重传的数据包
+    uint64_t data_bytes = 0;    // 首次发送的数据字节数
+    size_t acks_received = 0;
+    size_t data_received = 0;   // 按序收到的数据包
+    size_t duplicates = 0;      // 重复收到的数据包（对方没收到 ACK）
+    size_t timeouts = 0;
+    size_t corrupt = 0;
+    uint32_t max_rto = 0;
+    double timeout_ms = 0;      // 等待超时花掉的总时间
+    double stall_ms = 0;        // 最长的非超时空闲
+    double stall_at_ms = 0;     // 最长空闲开始的时刻（相对于跟踪开始）
+    std::vector<double> rtt_us; // 没有重传的数据包的 RTT（Karn 算法）
+};
+
+/**
+ * @brief  按线程汇总记录
+ */
+static std::vector<FlowStats> summarize(const std::vector<TraceRecord>& records) {
+    std::map<uint32_t, FlowStats> flows;
+    std::map<uint32_t, TraceRecord> sent;        // 等待 ACK 的首次发送
+    std::map<uint32_t, uint32_t> last_seq;       // 接收方上一个数据包的序号
+    uint64_t start = records.empty() ? 0 : records.front().time_ns;
+    for (const TraceRecord& r : records) {
+        FlowStats& flow = flows[r.thread];
+        if (flow.first_ns == 0) {
+            flow.thread = r.thread;
+            flow.port = r.port;
+            flow.first_ns = r.time_ns;
+        } else if (r.event != TRACE_TIMEOUT) {
+            double gap_ms = (r.time_ns - flow.last_ns) / 1e6;
+            if (gap_ms > flow.stall_ms) {
+                flow.stall_ms = gap_ms;
+                flow.stall_at_ms = (flow.last_ns - start) / 1e6;
+            }
+        }
+        flow.last_ns = r.time_ns;
+        if (r.event == TRACE_SEND && isData(r)) {
+            if (r.retransmit) {
+                ++flow.retransmits;
+                sent.erase(r.thread);
+            } else {
+                ++flow.data_sent;
+                flow.data_bytes += r.length;
+                sent[r.thread] = r;
+            }
+            flow.max_rto = std::max(flow.max_rto, r.rto_ms);
+        } else if (r.event == TRACE_RECV && isDataAck(r)) {
+            ++flow.acks_received;
+            auto it = sent.find(r.thread);
+            if (it != sent.end() && it->second.seq == r.seq) {
+                flow.rtt_us.push_back((r.time_ns - it->second.time_ns) / 1e3);
+                sent.erase(it);
+            }
+        } else if (r.event == TRACE_RECV && isData(r)) {
+            auto it = last_seq.find(r.thread);
+            if (it != last_seq.end() && it->second == r.seq) {
+                ++flow.duplicates;
+            } else {
+                ++flow.data_received;
+            }
+            last_seq[r.thread] = r.seq;
+        } else if (r.event == TRACE_TIMEOUT) {
+            ++flow.timeouts;
+            flow.timeout_ms += r.rto_ms;
+        } else if (r.event == TRACE_CORRUPT) {
+            ++flow.corrupt;
+        }
+    }
+    std::vector<FlowStats> result;
+    for (auto& [thread, flow] : flows) {
+        result.push_back(std::move(flow));
+    }
+    return result;
+}
+
+static void printFlow(const char* name, FlowStats& flow) {
+    double seconds = (flow.last_ns - flow.first_ns) / 1e9;
+    printf("%s tid=%u port=%u duration=%.3fs\n", name, flow.thread, flow.port,
+           seconds);
+    if (flow.data_sent > 0) {
+        printf("  sent %zu data packets (%llu bytes, %.2f MiB/s), "
+               "%zu retransmits (%.2f%%), %zu acks\n",
+               flow.data_sent, static_cast<unsigned long long>(flow.data_bytes),
+               seconds > 0 ? flow.data_bytes / seconds / (1 << 20) : 0.0,
+               flow.retransmits, 100.0 * flow.retransmits / flow.data_sent,
+               flow.acks_received);
+    }
+    if (flow.data_received > 0 || flow.duplicates > 0) {
+        printf("  received %zu data packets, %zu duplicates\n",
+               flow.data_received, flow.duplicates);
+    }
+    if (flow.timeouts > 0 || flow.corrupt > 0) {
+        printf("  %zu timeouts waiting %.1fms in total, max rto %ums, "
+               "%zu corrupt\n",
+               flow.timeouts, flow.timeout_ms, flow.max_rto, flow.corrupt);
+    }
+    if (!flow.rtt_us.empty()) {
+        std::sort(flow.rtt_us.begin(), flow.rtt_us.end());
+        auto at = [&](double q) {
+            return flow.rtt_us[static_cast<size_t>(q * (flow.rtt_us.size() - 1))];
+        };
+        printf("  rtt min=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n", at(0),
+               at(0.5), at(0.99), at(1));
+    }
+    printf("  longest stall %.3fms at %.3fms\n", flow.stall_ms,
+           flow.stall_at_ms);
+}
+
+static int printSummary(int argc, char* argv[]) {
+    std::vector<TraceRecord> records;
+    if (loadTraces(argc, argv, records) < 0) {
+        return -1;
+    }
+    for (FlowStats& flow : summarize(records)) {
+        printFlow("flow", flow);
+    }
+    return 0;
+}
+
+/**
+ * @brief  画时间-序列图（SVG）
+ *  横轴是时间，纵轴是每个发送线程已经发出的数据字节数，和 tcptrace 的图相同：
+ * 首次发送画黑色竖线，重传画红色竖线，收到的 ACK 画绿色阶梯，超时画橙色圆点。
+ * 丢包表现为红线，退避表现为越来越长的水平空白，接收方停顿表现为绿线停住。
+ */
+static int drawGraph(int argc, char* argv[]) {
+    std::string output = argv[0];
+    std::vector<TraceRecord> records;
+    if (loadTraces(argc - 1, argv + 1, records) < 0) {
+        return -1;
+    }
+    if (records.empty()) {
+        LOG(ERROR) << "No records";
+        return -1;
+    }
+
+    struct Point {
+        double ms;
+        double from;
+        double to;
+    };
+    std::vector<Point> sends, retransmits, acks, timeouts;
+    std::map<uint32_t, uint64_t> offset;   // 每个线程已经发出的字节数
+    std::map<uint32_t, uint64_t> pending;  // 每个线程正在等待 ACK 的数据包长度
+    uint64_t start = records.front().time_ns;
+    double max_bytes = 1;
+    for (const TraceRecord& r : records) {
+        double ms = (r.time_ns - start) / 1e6;
+        uint64_t& sent = offset[r.thread];
+        if (r.event == TRACE_SEND && isData(r)) {
+            if (!r.retransmit) {
+                sent += pending[r.thread];
+                pending[r.thread] = r.length;
+            }
+            (r.retransmit ? retransmits : sends)
+                .push_back({ms, double(sent), double(sent + r.length)});
+            max_bytes = std::max(max_bytes, double(sent + r.length));
+        } else if (r.event == TRACE_RECV && isDataAck(r)) {
+            acks.push_back({ms, double(sent + pending[r.thread]), 0});
+        } else if (r.event == TRACE_TIMEOUT) {
+            timeouts.push_back({ms, double(sent), 0});
+        }
+    }
+    double max_ms = std::max((records.back().time_ns - start) / 1e6, 1e-3);
+
+    FILE* file = fopen(output.c_str(), "w");
+    if (file == nullptr) {
+        LOG(ERROR) << "Failed to open " << output;
+        return -1;
+    }
+    const double width = 1200, height = 700, margin = 70;
+    auto x = [&](double ms) { return margin + ms / max_ms * (width - 2 * margin); };
+    auto y = [&](double bytes) {
+        return height - margin - bytes / max_bytes * (height - 2 * margin);
+    };
+    fprintf(file,
+            "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%.0f\" "
+            "height=\"%.0f\" font-family=\"monospace\" font-size=\"12\">\n"
+            "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+            width, height);
+    // 坐标轴和刻度
+    fprintf(file,
+            "<path d=\"M%.0f %.0f V%.0f H%.0f\" stroke=\"black\" fill=\"none\"/>\n",
+            margin, margin, height - margin, width - margin);
+    for (int i = 0; i <= 5; ++i) {
+        fprintf(file,
+                "<text x=\"%.1f\" y=\"%.1f\" text-anchor=\"middle\">%.1fms</text>\n",
+                x(max_ms * i / 5), height - margin + 20, max_ms * i / 5);
+        fprintf(file,
+                "<text x=\"%.1f\" y=\"%.1f\" text-anchor=\"end\">%.0fKiB</text>\n",
+                margin - 5, y(max_bytes * i / 5) + 4, max_bytes * i / 5 / 1024);
+    }
+    auto segments = [&](const std::vector<Point>& points, const char* color) {
+        fprintf(file, "<path stroke=\"%s\" fill=\"none\" d=\"", color);
+        for (const Point& p : points) {
+            fprintf(file, "M%.2f %.2fV%.2f", x(p.ms), y(p.from), y(p.to));
+        }
+        fprintf(file, "\"/>\n");
+    };
+    segments(sends, "black");
+    segments(retransmits, "red");
+    fprintf(file, "<path stroke=\"green\" fill=\"none\" d=\"");
+    for (size_t i = 0; i < acks.size(); ++i) {
+        fprintf(file, "%c%.2f %.2f", i == 0 ? 'M' : 'L', x(acks[i].ms),
+                y(acks[i].from));
+        if (i + 1 < acks.size()) {
+            fprintf(file, "H%.2f", x(acks[i + 1].ms));
+        }
+    }
+    fprintf(file, "\"/>\n");
+    for (const Point& p : timeouts) {
+        fprintf(file, "<circle cx=\"%.2f\" cy=\"%.2f\" r=\"3\" fill=\"orange\"/>\n",
+                x(p.ms), y(p.from));
+    }
+    fprintf(file,
+            "<text x=\"%.0f\" y=\"30\">send: black  retransmit: red  ack: green  "
+            "timeout: orange</text>\n</svg>\n",
+            margin);
+    fclose(file);
+    printf("Wrote %zu sends, %zu retransmits, %zu acks and %zu timeouts to %s\n",
+           sends.size(), retransmits.size(), acks.size(), timeouts.size(),
+           output.c_str());
+    return 0;
+}
+
+/**
+ * @brief  从跟踪中提取的发送计划
+ */
+struct ReplayPlan {
+    std::vector<uint32_t> lengths;  // 每个数据包的长度
+    std::vector<uint64_t> waits;    // 发送每个数据包之前的空闲（纳秒）
+    std::vector<bool> lost;         // 每次发送（包括重传）是否丢失
+    int rto_ms = RTO_MS;
+};
+
+/**
+ * @brief  从发送数据包最多的线程中提取发送计划
+ *  一次发送之后没有收到对应的 ACK 就重传了，就认为这次发送丢失；ACK 丢失和
+ * 数据包丢失对发送方的影响相同，重放时都当作数据包丢失。两个数据包之间的空闲
+ * （上一个 ACK 到下一次首次发送）是发送方应用的停顿，重放时原样等待。
+ */
+static ReplayPlan extractPlan(const std::vector<TraceRecord>& records) {
+    std::map<uint32_t, size_t> data_sends;
+    for (const TraceRecord& r : records) {
+        if (r.event == TRACE_SEND && isData(r)) {
+            ++data_sends[r.thread];
+        }
+    }
+    ReplayPlan plan;
+    if (data_sends.empty()) {
+        return plan;
+    }
+    uint32_t sender = std::max_element(data_sends.begin(), data_sends.end(),
+                                       [](const auto& a, const auto& b) {
+                                           return a.second < b.second;
+                                       })
+                          ->first;
+    uint64_t last_ack_ns = 0;
+    uint32_t seq = 0;
+    bool acked = true;
+    for (const TraceRecord& r : records) {
+        if (r.thread != sender) {
+            continue;
+        }
+        if (r.event == TRACE_SEND && isData(r)) {
+            if (r.retransmit) {
+                if (!acked && !plan.lost.empty()) {
+                    plan.lost.back() = true;
+                }
+            } else {
+                plan.lengths.push_back(std::min<uint32_t>(r.length, DATA_SIZE));
+                plan.waits.push_back(last_ack_ns ? r.time_ns - last_ack_ns : 0);
+                if (plan.lengths.size() == 1 && r.rto_ms > 0) {
+                    plan.rto_ms = r.rto_ms;
+                }
+            }
+            plan.lost.push_back(false);
+            seq = r.seq;
+            acked = false;
+        } else if (r.event == TRACE_RECV && isDataAck(r) && r.seq == seq) {
+            acked = true;
+            last_ack_ns = r.time_ns;
+        }
+    }
+    return plan;
+}
+
+/**
+ * @brief  重放
+ *  在本机启动服务端和丢包中继，按发送计划经过中继发送同样长度的数据包，
+ * 中继丢弃跟踪中丢失的那几次发送，重放本身也记录跟踪，最后对比两次的汇总。
+ * 时间上只重现发送方的停顿和重传超时，链路本身的时延是本机回环的时延。
+ * @param argv  跟踪文件，以及可选的重放跟踪的输出目录
+ */
+static int replay(int argc, char* argv[]) {
+    std::vector<TraceRecord> records;
+    if (loadTraces(1, argv, records) < 0) {
+        return -1;
+    }
+    std::string dir = argc > 1 ? argv[1] : "replay-trace";
+    ReplayPlan plan = extractPlan(records);
+    if (plan.lengths.empty()) {
+        LOG(ERROR) << "No data packets in trace";
+        return -1;
+    }
+    size_t lost = std::count(plan.lost.begin(), plan.lost.end(), true);
+    printf("Replaying %zu packets, %zu of %zu sends lost, rto %dms\n",
+           plan.lengths.size(), lost, plan.lost.size(), plan.rto_ms);
+
+    sockaddr_in server_addr{};
+    int server_fd = bindLoopback(server_addr);
+    LossyRelay relay;
+    size_t index = 0;  // 中继看到的第几次数据包发送
+    relay.drop = [&](const Packet& pkt, bool from_server) {
+        if (from_server || (pkt.type & TYPE_MASK) != DATA) {
+            return false;
+        }
+        size_t i = index++;
+        return i < plan.lost.size() && plan.lost[i];
+    };
+    if (server_fd < 0 || startRelay(relay, server_addr, 0) < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return -1;
+    }
+    if (rudp_trace_start(dir) < 0) {
+        LOG(ERROR) << "Failed to create trace directory " << dir;
+        return -1;
+    }
+
+    std::thread server([&] {
+        sockaddr_in client_addr{};
+        rudp_accept(server_fd, client_addr);
+        char buffer[DATA_SIZE];
+        uint32_t expected_seq = 0;
+        for (size_t i = 0; i < plan.lengths.size(); ++i) {
+            rudp_receive_data(server_fd, buffer, DATA_SIZE, client_addr,
+                              expected_seq);
+        }
+        rudp_wait_close(server_fd, client_addr);
+    });
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr = relay.addr;
+    rudp_connect(fd, addr);
+    std::vector<char> data(DATA_SIZE, 'x');
+    uint32_t seq_num = 0;
+    DeliveryPolicy policy;
+    policy.rto_ms = plan.rto_ms;
+    for (size_t i = 0; i < plan.lengths.size(); ++i) {
+        if (plan.waits[i] >= REPLAY_MIN_WAIT_NS) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(plan.waits[i]));
+        }
+        rudp_send_data(fd, data.data(), plan.lengths[i], addr, seq_num, policy);
+    }
+    rudp_close_connection(fd, addr);
+    server.join();
+    // rudp_trace_stop 会解除缓冲区的映射，先导出
+    std::string output = dir + "/replay.trace";
+    std::vector<TraceRecord> replayed;
+    int dumped = rudp_trace_dump(output);
+    rudp_trace_stop();
+    stopRelay(relay);
+    close(fd);
+    close(server_fd);
+
+    if (dumped < 0 || traceRead(output, replayed) < 0) {
+        LOG(ERROR) << "Failed to write " << output;
+        return -1;
+    }
+    for (FlowStats& flow : summarize(records)) {
+        if (flow.data_sent > 0) {
+            printFlow("original", flow);
+        }
+    }
+    for (FlowStats& flow : summarize(replayed)) {
+        if (flow.data_sent > 0) {
+            printFlow("replay", flow);
+        }
+    }
+    printf("Replay trace written to %s\n", output.c_str());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::string process_name = argv[0];
+    google::InitGoogleLogging(argv[0]);
+
+    // 日志配置，重放时每个数据包一条 INFO 日志会改变时序，这里只输出错误
+    FLAGS_logtostderr = 1;
+    FLAGS_minloglevel = 2;
+
+    if (argc < 3) {
+        LOG(ERROR) << "Usage: " << process_name << " <command> [args]\n"
+                   << "  print <trace...>\n"
+                   << "  summary <trace...>\n"
+                   << "  graph <output.svg> <trace...>\n"
+                   << "  replay <trace> [output directory]";
+        return -1;
+    }
+
+    std::string command = argv[1];
+    if (command == "print") {
+        return printRecords(argc - 2, argv + 2);
+    }
+    if (command == "summary") {
+        return printSummary(argc - 2, argv + 2);
+    }
+    if (command == "graph" && argc > 3) {
+        return drawGraph(argc - 2, argv + 2);
+    }
+    if (command == "replay") {
+        return replay(argc - 2, argv + 2);
+    }
+    LOG(ERROR) << "Unknown command: " << command;
+    return -1;
+}
@@ -0,0 +1,400 @@
+// trace.h
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// 二进制数据包跟踪：每个线程一个环形缓冲区，每个数据包写入一条固定大小的记录，
+// 开启后每个数据包只多一次几十字节的内存写入，可以在线上一直开着。
+//
+// 环形缓冲区是 MAP_SHARED 映射的文件，记录写进去就已经在页缓存中，
+// 进程崩溃（包括被 SIGKILL）之后文件里仍然是每个线程最后 capacity 条记录，
+// 不需要信号处理函数。运行中可以随时调用 rudp_trace_dump 把所有线程的记录
+// 按时间合并到一个文件中。两种文件格式相同，都可以交给 trace-tool 分析。
+
+const uint32_t TRACE_MAGIC = 0x54445552;  // "RUDT"
+const uint32_t TRACE_VERSION = 1;
+const uint32_t TRACE_RECORDS = 1 << 16;  // 每个线程默认保留的记录数
+
+enum TraceEvent : uint8_t {
+    TRACE_SEND,     // 发出一个数据包
+    TRACE_RECV,     // 收到一个校验通过的数据包
+    TRACE_TIMEOUT,  // 等待应答超时
+    TRACE_CORRUPT,  // 收到校验失败的数据包
+};
+
+/**
+ * @brief  一条跟踪记录
+ *  rto_ms、window 和 cwnd 是记录时发送方的状态，由协议层写入 rudp_trace_state。
+ */
+struct TraceRecord {
+    uint64_t time_ns;    // CLOCK_MONOTONIC
+    uint8_t event;       // TraceEvent
+    uint8_t retransmit;  // 发送的是重传的数据包
+    uint16_t port;       // 对端端口
+    uint32_t thread;     // 线程 id
+    uint32_t type;       // 数据包类型，包括标志位
+    uint32_t seq;
+    uint32_t length;  // 数据长度
+    uint32_t rto_ms;  // 重传超时（毫秒）
+    uint32_t window;  // 允许在途的数据包数
+    uint32_t cwnd;    // 拥塞窗口（字节），没有拥塞控制时为 0
+};
+
+static_assert(sizeof(TraceRecord) == 40, "trace records are fixed size");
+
+/**
+ * @brief  跟踪文件的头部
+ *  头部之后是 capacity 条记录，第 i 条记录写在 i % capacity 处。
+ */
+struct TraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;            // 记录槽位数
+    uint32_t pid;
+    std::atomic<uint64_t> count;  // 写入过的记录总数
+    char reserved[40];
+};
+
+static_assert(sizeof(TraceHeader) == 64, "trace header is fixed size");
+
+/**
+ * @brief  当前线程的发送方状态，写入之后的每条记录都带上这些值
+ */
+struct TraceState {
+    uint32_t rto_ms;
+    uint32_t window;
+    uint32_t cwnd;
+    bool retransmit;
+};
+
+/**
+ * @brief  一个线程的环形缓冲区
+ *  header 和 records 只由所属线程（持有锁）映射，由 rudp_trace_stop（持有锁，
+ * 并且等到 writing 清除之后）解除映射。
+ */
+struct TraceRing {
+    TraceHeader* header = nullptr;  // 停止记录后为空，重新开启时映射新文件
+    TraceRecord* records = nullptr;
+    size_t size = 0;  // 映射的字节数
+    uint32_t thread = 0;
+    std::atomic<bool> writing{false};  // 所属线程正在写入记录
+    bool exited = false;  // 所属线程已经退出，停止记录时释放
+};
+
+// 是否在记录，在 rudp_trace_start 之后为 true
+std::atomic<bool> rudp_trace_enabled{false};
+std::mutex rudp_trace_mutex;  // 保护下面的目录、容量、文件序号和所有缓冲区的列表
+std::string rudp_trace_dir;
+uint32_t rudp_trace_capacity = TRACE_RECORDS;
+uint32_t rudp_trace_files = 0;  // 本进程创建过的缓冲区文件数
+std::vector<TraceRing*> rudp_trace_rings;
+thread_local TraceRing* rudp_trace_ring = nullptr;
+thread_local bool rudp_trace_failed = false;  // 创建缓冲区失败后不再重试
+thread_local TraceState rudp_trace_state{};
+
+/**
+ * @brief  线程退出时处理它的缓冲区
+ *  还映射着的缓冲区 rudp_trace_dump 还要读取，留到 rudp_trace_stop 释放，
+ * 已经解除映射的直接释放。
+ */
+struct TraceRingOwner {
+    TraceRing* ring = nullptr;
+
+    ~TraceRingOwner() {
+        if (ring == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(rudp_trace_mutex);
+        if (ring->header != nullptr) {
+            ring->exited = true;
+            return;
+        }
+        rudp_trace_rings.erase(
+            std::find(rudp_trace_rings.begin(), rudp_trace_rings.end(), ring));
+        delete ring;
+    }
+};
+
+thread_local TraceRingOwner rudp_trace_owner;
+
+/**
+ * @brief  开始记录
+ *  每个线程在第一次记录时在 dir 下创建 rudp-trace.<pid>.<tid>.<n> 文件，
+ * n 是本进程内的文件序号，线程 id 被复用或者停止后重新开启记录时都换一个新文件。
+ * 目录和容量只在第一次调用时生效，之后再调用只是重新开启记录。
+ * @param dir  跟踪文件所在的目录，不存在时会被创建
+ * @param records  每个线程保留的记录数
+ * @return int  返回 0 表示成功，-1 表示目录无法创建
+ */
+int rudp_trace_start(const std::string& dir, uint32_t records = TRACE_RECORDS) {
+    std::lock_guard<std::mutex> lock(rudp_trace_mutex);
+    if (rudp_trace_dir.empty()) {
+        if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        rudp_trace_dir = dir;
+        rudp_trace_capacity = std::max<uint32_t>(records, 1);
+    }
+    rudp_trace_enabled.store(true);
+    return 0;
+}
+
+/**
+ * @brief  环境变量 RUDP_TRACE_DIR 不为空时开始记录，记录到这个目录
+ * @return int  返回 0 表示成功或者没有设置，-1 表示目录无法创建
+ */
+int rudp_trace_from_env() {
+    const char* dir = getenv("RUDP_TRACE_DIR");
+    return dir != nullptr && *dir != '\0' ? rudp_trace_start(dir) : 0;
+}
+
+/**
+ * @brief  停止记录，解除所有缓冲区的映射
+ *  已经写入的记录仍然保留在文件中，需要合并导出时先调用 rudp_trace_dump。
+ * 正在写入记录的线程写完之后才解除映射，已经退出的线程的缓冲区在这里释放。
+ */
+void rudp_trace_stop() {
+    std::lock_guard<std::mutex> lock(rudp_trace_mutex);
+    rudp_trace_enabled.store(false);
+    std::vector<TraceRing*> rings;
+    for (TraceRing* ring : rudp_trace_rings) {
+        while (ring->writing.load()) {
+            std::this_thread::yield();
+        }
+        if (ring->header != nullptr) {
+            munmap(ring->header, ring->size);
+            ring->header = nullptr;
+            ring->records = nullptr;
+        }
+        if (ring->exited) {
+            delete ring;
+        } else {
+            rings.push_back(ring);
+        }
+    }
+    rudp_trace_rings.swap(rings);
+}
+
+/**
+ * @brief  为当前线程映射一个新的环形缓冲区文件
+ *  第一次调用时创建 TraceRing，停止后重新开启记录时复用它。
+ * @return TraceRing*  返回缓冲区，失败或者已经停止记录时返回空指针
+ */
+TraceRing* traceOpenRing() {
+    std::lock_guard<std::mutex> lock(rudp_trace_mutex);
+    if (!rudp_trace_enabled.load()) {
+        return nullptr;
+    }
+    uint32_t thread = syscall(SYS_gettid);
+    // 线程 id 会被复用，带上序号才不会截断列表中其他缓冲区的文件
+    std::string path = rudp_trace_dir + "/rudp-trace." +
+                       std::to_string(getpid()) + "." + std::to_string(thread) +
+                       "." + std::to_string(rudp_trace_files++);
+    size_t size = sizeof(TraceHeader) +
+                  static_cast<size_t>(rudp_trace_capacity) * sizeof(TraceRecord);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        rudp_trace_failed = true;
+        return nullptr;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        rudp_trace_failed = true;
+        return nullptr;
+    }
+    TraceRing* ring = rudp_trace_ring;
+    if (ring == nullptr) {
+        ring = new TraceRing;
+        ring->thread = thread;
+        rudp_trace_rings.push_back(ring);
+        rudp_trace_ring = ring;
+        rudp_trace_owner.ring = ring;
+    }
+    ring->header = static_cast<TraceHeader*>(map);
+    ring->records = reinterpret_cast<TraceRecord*>(ring->header + 1);
+    ring->size = size;
+    ring->header->magic = TRACE_MAGIC;
+    ring->header->version = TRACE_VERSION;
+    ring->header->capacity = rudp_trace_capacity;
+    ring->header->pid = getpid();
+    return ring;
+}
+
+/**
+ * @brief  记录一个事件
+ *  没有开启记录时只有一次原子读取。每个缓冲区只有所属线程写入，
+ * 先写记录再增加计数，读取方看到的计数之内的记录都是完整的。
+ *  rudp_trace_stop 先关闭记录再等待 writing 清除，这里先置位 writing 再检查
+ * 记录是否开启，看到开启时映射在写完之前一直有效。
+ * @param event  事件
+ * @param type  数据包类型
+ * @param seq  序号
+ * @param length  数据长度
+ * @param addr  对端地址
+ */
+void traceRecord(uint8_t event, uint32_t type, uint32_t seq, uint32_t length,
+                 const sockaddr_in& addr) {
+    if (!rudp_trace_enabled.load(std::memory_order_relaxed)) {
+        return;
+    }
+    TraceRing* ring = rudp_trace_ring;
+    if (ring == nullptr) {
+        if (rudp_trace_failed || (ring = traceOpenRing()) == nullptr) {
+            return;
+        }
+    }
+    ring->writing.store(true);
+    if (rudp_trace_enabled.load() && ring->header == nullptr) {
+        // 上次停止记录时解除了映射，映射新文件要拿锁，先清除 writing，
+        // 否则持有锁的 rudp_trace_stop 会一直等待
+        ring->writing.store(false);
+        if (rudp_trace_failed || traceOpenRing() == nullptr) {
+            return;
+        }
+        ring->writing.store(true);
+    }
+    if (!rudp_trace_enabled.load() || ring->header == nullptr) {
+        ring->writing.store(false, std::memory_order_release);
+        return;
+    }
+    uint64_t index = ring->header->count.load(std::memory_order_relaxed);
+    TraceRecord& record = ring->records[index % ring->header->capacity];
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record.time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    record.event = event;
+    record.retransmit = rudp_trace_state.retransmit;
+    record.port = ntohs(addr.sin_port);
+    record.thread = ring->thread;
+    record.type = type;
+    record.seq = seq;
+    record.length = length;
+    record.rto_ms = rudp_trace_state.rto_ms;
+    record.window = rudp_trace_state.window;
+    record.cwnd = rudp_trace_state.cwnd;
+    ring->header->count.store(index + 1, std::memory_order_release);
+    ring->writing.store(false, std::memory_order_release);
+}
+
+/**
+ * @brief  按写入顺序取出一个缓冲区中保留的记录
+ * @param header  缓冲区头部
+ * @param records  缓冲区中的记录
+ * @param out  追加到这里
+ */
+void traceCollect(const TraceHeader* header, const TraceRecord* records,
+                  std::vector<TraceRecord>& out) {
+    uint64_t count = header->count.load(std::memory_order_acquire);
+    uint64_t first = count > header->capacity ? count - header->capacity : 0;
+    for (uint64_t i = first; i < count; ++i) {
+        out.push_back(records[i % header->capacity]);
+    }
+}
+
+/**
+ * @brief  写出跟踪文件，capacity 等于记录数，不会回绕
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int traceWrite(const std::string& path, const std::vector<TraceRecord>& records) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        return -1;
+    }
+    TraceHeader header{};
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.capacity = std::max<size_t>(records.size(), 1);
+    header.pid = getpid();
+    header.count.store(records.size());
+    // 没有记录时也写一个空槽位，保证文件中有 capacity 条记录
+    TraceRecord empty{};
+    const TraceRecord* slots = records.empty() ? &empty : records.data();
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(slots, sizeof(TraceRecord), header.capacity, file) ==
+                  header.capacity;
+    return fclose(file) == 0 && ok ? 0 : -1;
+}
+
+/**
+ * @brief  把所有线程的记录按时间合并写入一个文件
+ *  其他线程可能同时在写，正在被覆盖的最旧的几条记录可能不一致。
+ * 只包括还映射着的缓冲区，要在 rudp_trace_stop 之前调用。
+ * @param path  输出文件
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int rudp_trace_dump(const std::string& path) {
+    std::vector<TraceRecord> records;
+    {
+        std::lock_guard<std::mutex> lock(rudp_trace_mutex);
+        for (TraceRing* ring : rudp_trace_rings) {
+            if (ring->header != nullptr) {
+                traceCollect(ring->header, ring->records, records);
+            }
+        }
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const TraceRecord& a, const TraceRecord& b) {
+                         return a.time_ns < b.time_ns;
+                     });
+    return traceWrite(path, records);
+}
+
+/**
+ * @brief  读取跟踪文件（线程的缓冲区文件或者 rudp_trace_dump 的输出）
+ *  头部中的 capacity 要和文件大小相符才分配记录，损坏或者截断的文件不会
+ * 导致巨大的分配。
+ * @param path  文件路径
+ * @param out  记录追加到这里
+ * @return int  返回 0 表示成功，-1 表示文件不存在或者格式错误
+ */
+int traceRead(const std::string& path, std::vector<TraceRecord>& out) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return -1;
+    }
+    TraceHeader header;
+    std::vector<TraceRecord> records;
+    struct stat st;
+    bool ok = fstat(fileno(file), &st) == 0 &&
+              fread(&header, sizeof(header), 1, file) == 1 &&
+              header.magic == TRACE_MAGIC && header.version == TRACE_VERSION &&
+              header.capacity > 0 &&
+              sizeof(TraceHeader) +
+                      static_cast<uint64_t>(header.capacity) * sizeof(TraceRecord) <=
+                  static_cast<uint64_t>(st.st_size);
+    if (ok) {
+        records.resize(header.capacity);
+        ok = fread(records.data(), sizeof(TraceRecord), records.size(), file) ==
+             records.size();
+    }
+    fclose(file);
+    if (!ok) {
+        return -1;
+    }
+    traceCollect(&header, records.data(), out);
+    return 0;
+}
+
+#endif  // TRACE_H
@@ -0,0 +1,928 @@
+// transfer.h
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "compress.h"
+#include "rudp.h"
+
+// 文件传输：把大文件切成固定大小的块，或者把目录展开成文件清单，
+// 由多个工作线程通过多条 RUDP 连接同时发送，接收方按偏移写入。
+// 并行传输时第 i 条连接使用服务端的 port + i 端口，每个端口一个 socket、一个线程，
+// 连接数在第 0 条连接建立后协商，取两端连接数的较小值。
+//
+// 传输可以断点续传：清单中带有每个块的摘要，接收方对已有的文件逐块计算摘要，
+// 回复一个位图说明哪些块需要发送，发送方只发送缺失或者内容不同的块。
+//
+// 发送方可以在清单中提出压缩，接收方在位图前面回复是否同意。协商成功后
+// 每个块发送前先做 LZ 压缩，压缩率太低或者压缩比发送还慢时自动改为发送原始数据。
+
+const size_t STRIPE_CHUNK_SIZE = 1 << 20;  // 每个传输块的大小（1 MiB）
+const uint32_t CHUNK_END = 0xffffffff;     // 表示该连接上的块已经发完
+const uint32_t FEATURE_COMPRESS = 1 << 0;  // 特性位：块数据可以压缩
+const uint32_t CHUNK_COMPRESSED = 1 << 0;  // 块标志：块数据经过压缩
+const uint64_t MAX_FILE_SIZE = 1ULL << 44;  // 清单中单个文件的大小上限（16 TiB）
+
+/**
+ * @brief  清单中的一个文件
+ */
+struct FileEntry {
+    std::string path;               // 相对路径
+    uint64_t size;                  // 文件大小
+    std::vector<uint64_t> digests;  // 每个块的 XXH64 摘要
+};
+
+/**
+ * @brief  传输块的头部
+ *  每个块作为一条消息发送，头部后面紧跟块数据。
+ */
+struct ChunkHeader {
+    uint32_t file_index;  // 文件在清单中的下标，CHUNK_END 表示结束
+    uint32_t flags;       // CHUNK_COMPRESSED 等
+    uint64_t offset;  // 块在文件中的偏移
+};
+
+/**
+ * @brief  传输统计
+ */
+struct TransferStats {
+    uint64_t bytes = 0;    // 传输的字节数
+    uint64_t skipped = 0;  // 接收方已有、不需要发送的字节数
+    uint64_t wire = 0;     // 实际发送的块数据字节数（压缩后）
+    size_t files = 0;      // 传输的文件数
+    size_t streams = 0;    // 使用的连接数
+    double seconds = 0;    // 耗时（秒）
+};
+
+/**
+ * @brief  一条已经建立的连接
+ *  同一条连接上两个方向的消息交替进行，两个方向的序号都要跨调用保存。
+ */
+struct Stream {
+    int sockfd;
+    sockaddr_in addr;
+    uint32_t seq_num = 0;       // 发送方向的序号
+    uint32_t expected_seq = 0;  // 接收方向期望的序号
+};
+
+/**
+ * @brief  一个待发送的块
+ */
+struct ChunkTask {
+    uint32_t file_index;
+    uint64_t offset;
+    uint64_t length;
+};
+
+const uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+const uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+/**
+ * @brief  XXH64 哈希
+ *  非加密的快速哈希，每个核每秒可以处理若干 GB，用来比较块的内容。
+ * @param data  输入数据
+ * @param len  数据长度
+ * @param seed  种子
+ * @return uint64_t  返回哈希值
+ */
+uint64_t xxh64(const uint8_t* data, size_t len, uint64_t seed = 0) {
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto read64 = [](const uint8_t* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    };
+    auto read32 = [](const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    };
+    auto round = [&](uint64_t acc, uint64_t input) {
+        acc += input * XXH_PRIME64_2;
+        acc = rotl(acc, 31);
+        return acc * XXH_PRIME64_1;
+    };
+    auto merge = [&](uint64_t acc, uint64_t val) {
+        acc ^= round(0, val);
+        return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+    };
+
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        const uint8_t* limit = end - 32;
+        do {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+    h += len;
+
+    while (p + 8 <= end) {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * XXH_PRIME64_1;
+        h = rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= *p * XXH_PRIME64_5;
+        h = rotl(h, 11) * XXH_PRIME64_1;
+        ++p;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief  检查清单中的路径是否安全
+ *  只允许相对路径，并且不能包含 ".."，防止写到输出目录之外。
+ * @param path  清单中的路径
+ * @return bool  路径安全返回 true
+ */
+bool safeRelativePath(const std::string& path) {
+    std::filesystem::path p(path);
+    if (path.empty() || p.is_absolute()) {
+        return false;
+    }
+    for (const auto& part : p) {
+        if (part == "..") {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief  生成文件清单
+ *  path 是文件时清单只有这一个文件；是目录时递归列出其中所有普通文件。
+ * 相对路径都相对于 path 的上一级目录，这样目录名本身也会保留下来。
+ * 这里只填写路径和大小，摘要由 hashChunks 计算。
+ * @param path  要发送的文件或目录
+ * @param files  返回的清单
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int buildManifest(const std::string& path, std::vector<FileEntry>& files) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path root = fs::absolute(path, ec).lexically_normal();
+    if (root.has_filename() == false) {
+        root = root.parent_path();
+    }
+    fs::path base = root.parent_path();
+
+    files.clear();
+    if (fs::is_regular_file(root, ec)) {
+        files.push_back({root.filename().string(), fs::file_size(root, ec), {}});
+        return ec ? -1 : 0;
+    }
+    if (!fs::is_directory(root, ec)) {
+        LOG(ERROR) << "Not a file or directory: " << path;
+        return -1;
+    }
+    for (const auto& entry : fs::recursive_directory_iterator(root, ec)) {
+        if (entry.is_regular_file()) {
+            files.push_back({entry.path().lexically_relative(base).string(),
+                             entry.file_size(),
+                             {}});
+        }
+    }
+    return ec ? -1 : 0;
+}
+
+/**
+ * @brief  文件的块数
+ *  size 可能来自对端的清单，不能先加再除，接近 UINT64_MAX 时会回绕成 0。
+ */
+size_t chunkCount(uint64_t size) {
+    return size / STRIPE_CHUNK_SIZE + (size % STRIPE_CHUNK_SIZE != 0);
+}
+
+/**
+ * @brief  序列化文件清单
+ *  格式：特性位 (uint32)、文件数 (uint32)，然后每个文件依次为大小 (uint64)、
+ * 路径长度 (uint32)、路径和每个块的摘要 (uint64 × 块数)。
+ * @param files  文件清单
+ * @param features  发送方提出的特性位
+ * @return std::vector<char>  返回序列化后的数据
+ */
+std::vector<char> encodeManifest(const std::vector<FileEntry>& files,
+                                 uint32_t features) {
+    std::vector<char> out;
+    auto put = [&out](const void* data, size_t length) {
+        const char* p = static_cast<const char*>(data);
+        out.insert(out.end(), p, p + length);
+    };
+    uint32_t count = files.size();
+    put(&features, sizeof(features));
+    put(&count, sizeof(count));
+    for (const auto& file : files) {
+        uint32_t path_length = file.path.size();
+        put(&file.size, sizeof(file.size));
+        put(&path_length, sizeof(path_length));
+        put(file.path.data(), path_length);
+        put(file.digests.data(), file.digests.size() * sizeof(uint64_t));
+    }
+    return out;
+}
+
+/**
+ * @brief  解析文件清单
+ * @param data  序列化后的清单
+ * @param files  返回的清单
+ * @param features  返回发送方提出的特性位
+ * @return bool  格式正确、路径都安全、文件大小不超过 MAX_FILE_SIZE 并且
+ * 每个块都有摘要时返回 true
+ */
+bool decodeManifest(std::span<const char> data, std::vector<FileEntry>& files,
+                    uint32_t& features) {
+    size_t pos = 0;
+    auto get = [&](void* dest, size_t length) {
+        if (length > data.size() - pos) {
+            return false;
+        }
+        memcpy(dest, data.data() + pos, length);
+        pos += length;
+        return true;
+    };
+    uint32_t count;
+    if (!get(&features, sizeof(features)) || !get(&count, sizeof(count))) {
+        return false;
+    }
+    files.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        FileEntry file;
+        uint32_t path_length;
+        if (!get(&file.size, sizeof(file.size)) ||
+            !get(&path_length, sizeof(path_length)) ||
+            path_length > data.size() - pos) {
+            return false;
+        }
+        file.path.assign(data.data() + pos, path_length);
+        pos += path_length;
+        if (!safeRelativePath(file.path)) {
+            LOG(ERROR) << "Unsafe path in manifest: " << file.path;
+            return false;
+        }
+        // 文件大小决定接收方的块任务数和 ftruncate 的大小，不能直接相信
+        if (file.size > MAX_FILE_SIZE) {
+            LOG(ERROR) << "File too large in manifest: " << file.path << " ("
+                       << file.size << " bytes)";
+            return false;
+        }
+        size_t chunks = chunkCount(file.size);
+        if (chunks > (data.size() - pos) / sizeof(uint64_t)) {
+            return false;
+        }
+        file.digests.resize(chunks);
+        get(file.digests.data(), chunks * sizeof(uint64_t));
+        files.push_back(std::move(file));
+    }
+    return true;
+}
+
+/**
+ * @brief  把清单中的文件切成传输块
+ *  块的顺序就是位图中位的顺序。
+ * @param files  文件清单
+ * @return std::vector<ChunkTask>  返回所有块
+ */
+std::vector<ChunkTask> splitChunks(const std::vector<FileEntry>& files) {
+    std::vector<ChunkTask> tasks;
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        for (uint64_t offset = 0; offset < files[i].size;
+             offset += STRIPE_CHUNK_SIZE) {
+            uint64_t remaining = files[i].size - offset;
+            tasks.push_back({i, offset,
+                             remaining < STRIPE_CHUNK_SIZE ? remaining
+                                                           : STRIPE_CHUNK_SIZE});
+        }
+    }
+    return tasks;
+}
+
+/**
+ * @brief  并行计算块的摘要
+ *  按 CPU 核数启动线程，每个线程从任务列表中取块，pread 读出后计算 XXH64。
+ * 读不满一个块（文件不存在或者比清单中短）时对应的结果为空。
+ * @param fds  每个文件的文件描述符，小于 0 表示文件不存在
+ * @param tasks  要计算的块
+ * @return std::vector<std::optional<uint64_t>>  返回每个块的摘要
+ */
+std::vector<std::optional<uint64_t>> hashChunks(
+    const std::vector<int>& fds, const std::vector<ChunkTask>& tasks) {
+    std::vector<std::optional<uint64_t>> digests(tasks.size());
+    std::atomic<size_t> next_task{0};
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > tasks.size()) {
+        threads = tasks.size();
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([&] {
+            std::vector<uint8_t> buffer(STRIPE_CHUNK_SIZE);
+            while (true) {
+                size_t t = next_task.fetch_add(1);
+                if (t >= tasks.size()) {
+                    break;
+                }
+                const ChunkTask& task = tasks[t];
+                int fd = fds[task.file_index];
+                if (fd < 0 || pread(fd, buffer.data(), task.length,
+                                    task.offset) !=
+                                  static_cast<ssize_t>(task.length)) {
+                    continue;
+                }
+                digests[t] = xxh64(buffer.data(), task.length);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return digests;
+}
+
+/**
+ * @brief  发送文件或目录
+ *  在第 0 条连接上发送带摘要的清单，再接收接收方回复的位图，只有位图中置位的
+ * 块才需要发送。之后每条连接由一个工作线程负责，从共享的任务列表中取块、
+ * pread 读出后作为一条消息发送，最后在每条连接上发送结束标记。
+ *  压缩协商成功时，每个工作线程用自己的 CompressionPolicy 决定每个块是否压缩。
+ *  连接由调用方建立和关闭。
+ * @param streams  已经建立的连接
+ * @param path  要发送的文件或目录
+ * @param stats  返回传输统计
+ * @param compress  是否提出压缩
+ * @param pace  是否按节奏发送块数据
+ * @param txtime  按节奏发送时是否交给内核 SO_TXTIME，任何一条连接开启失败时
+ * 退回到用户态令牌桶
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int sendFiles(std::vector<Stream>& streams, const std::string& path,
+              TransferStats& stats, bool compress = false, bool pace = false,
+              bool txtime = false) {
+    std::vector<FileEntry> files;
+    if (buildManifest(path, files) < 0) {
+        LOG(ERROR) << "Failed to build manifest for " << path;
+        return -1;
+    }
+    std::filesystem::path base =
+        std::filesystem::absolute(path).lexically_normal().parent_path();
+
+    std::vector<int> fds;
+    for (const auto& file : files) {
+        int fd = open((base / file.path).c_str(), O_RDONLY);
+        if (fd < 0) {
+            LOG(ERROR) << "Failed to open file " << file.path;
+            for (int opened : fds) {
+                close(opened);
+            }
+            return -1;
+        }
+        fds.push_back(fd);
+    }
+
+    std::vector<ChunkTask> all_tasks = splitChunks(files);
+    std::vector<std::optional<uint64_t>> digests = hashChunks(fds, all_tasks);
+    for (size_t t = 0; t < all_tasks.size(); ++t) {
+        if (!digests[t]) {
+            LOG(ERROR) << "Failed to read "
+                       << files[all_tasks[t].file_index].path;
+            for (int fd : fds) {
+                close(fd);
+            }
+            return -1;
+        }
+        files[all_tasks[t].file_index].digests.push_back(*digests[t]);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Stream& control = streams[0];
+    std::vector<char> manifest =
+        encodeManifest(files, compress ? FEATURE_COMPRESS : 0);
+    rudp_send_message(control.sockfd, manifest, control.addr, control.seq_num,
+                      deliveryDuplex(control.expected_seq));
+    LOG(INFO) << "Sent manifest with " << files.size() << " files";
+
+    // 回复的格式：接收方同意的特性位 (uint32)，然后是位图
+    std::vector<char> reply;
+    if (rudp_recv_message(control.sockfd, reply, control.addr,
+                          control.expected_seq) !=
+        static_cast<ssize_t>(sizeof(uint32_t) + (all_tasks.size() + 7) / 8)) {
+        LOG(ERROR) << "Invalid chunk bitmap";
+        for (int fd : fds) {
+            close(fd);
+        }
+        return -1;
+    }
+    uint32_t features;
+    memcpy(&features, reply.data(), sizeof(features));
+    const char* bitmap = reply.data() + sizeof(features);
+    compress = compress && (features & FEATURE_COMPRESS);
+    LOG(INFO) << "Compression " << (compress ? "enabled" : "disabled");
+
+    stats = TransferStats();
+    stats.files = files.size();
+    stats.streams = streams.size();
+    std::vector<ChunkTask> tasks;
+    for (size_t t = 0; t < all_tasks.size(); ++t) {
+        if (bitmap[t / 8] & (1 << (t % 8))) {
+            tasks.push_back(all_tasks[t]);
+            stats.bytes += all_tasks[t].length;
+        } else {
+            stats.skipped += all_tasks[t].length;
+        }
+    }
+    LOG(INFO) << "Receiver needs " << tasks.size() << " of "
+              << all_tasks.size() << " chunks";
+
+    // 所有连接共用一个 Pacer：每条连接停等发送，在途的数据包数就是连接数，
+    // 按测得的 RTT 把它们均匀分散开，而不是每个 RTT 开始时同时发出。
+    // 这里没有拥塞控制，cwnd 是停等协议在途字节数的上限（固定值），
+    // 速率只随 RTT 变化
+    Pacer pacer;
+    pacerInit(control.sockfd, pacer, pace && txtime);
+    for (size_t i = 1; pacer.txtime && i < streams.size(); ++i) {
+        if (!enableTxtime(streams[i].sockfd)) {
+            LOG(WARNING) << "SO_TXTIME not available on stream " << i
+                         << ", using userspace pacing";
+            pacer.txtime = false;
+        }
+    }
+    pacer.cwnd = static_cast<double>(streams.size()) * sizeof(Packet);
+    DeliveryPolicy delivery;
+    if (pace) {
+        delivery.pacer = &pacer;
+    }
+
+    std::atomic<size_t> next_task{0};
+    std::atomic<uint64_t> wire{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        workers.emplace_back([&, i] {
+            using Clock = std::chrono::steady_clock;
+            Stream& stream = streams[i];
+            // 第一条连接上刚收到过位图，对方可能还在重传它
+            DeliveryPolicy duplex = delivery;
+            duplex.expected_seq = &stream.expected_seq;
+            std::vector<char> message(sizeof(ChunkHeader) + STRIPE_CHUNK_SIZE);
+            uint8_t* payload =
+                reinterpret_cast<uint8_t*>(message.data() + sizeof(ChunkHeader));
+            std::vector<uint8_t> raw(compress ? STRIPE_CHUNK_SIZE : 0);
+            CompressionPolicy policy;
+            while (true) {
+                size_t t = next_task.fetch_add(1);
+                if (t >= tasks.size()) {
+                    break;
+                }
+                const ChunkTask& task = tasks[t];
+                ChunkHeader header{task.file_index, 0, task.offset};
+                // 要压缩时读到临时缓冲区，压缩结果直接写到消息中
+                bool try_compress = compress && shouldCompress(policy);
+                uint8_t* dest = try_compress ? raw.data() : payload;
+                ssize_t n = pread(fds[task.file_index], dest, task.length,
+                                  task.offset);
+                if (n != static_cast<ssize_t>(task.length)) {
+                    LOG(ERROR) << "Failed to read "
+                               << files[task.file_index].path;
+                    failed = true;
+                    break;
+                }
+                size_t length = task.length;
+                if (try_compress) {
+                    auto begin = Clock::now();
+                    size_t packed =
+                        lzCompress(raw.data(), task.length, payload, task.length);
+                    recordCompress(
+                        policy, task.length, packed,
+                        std::chrono::duration<double, std::nano>(Clock::now() -
+                                                                 begin)
+                            .count());
+                    if (packed > 0) {
+                        header.flags = CHUNK_COMPRESSED;
+                        length = packed;
+                    } else {
+                        memcpy(payload, raw.data(), task.length);
+                    }
+                }
+                memcpy(message.data(), &header, sizeof(header));
+
+                auto begin = Clock::now();
+                rudp_send_message(
+                    stream.sockfd,
+                    std::span<const char>(message.data(),
+                                          sizeof(header) + length),
+                    stream.addr, stream.seq_num, duplex);
+                if (compress) {
+                    recordSend(policy, length,
+                               std::chrono::duration<double, std::nano>(
+                                   Clock::now() - begin)
+                                   .count());
+                }
+                wire += length;
+            }
+            ChunkHeader end{CHUNK_END, 0, 0};
+            rudp_send_message(
+                stream.sockfd,
+                std::span<const char>(reinterpret_cast<const char*>(&end),
+                                      sizeof(end)),
+                stream.addr, stream.seq_num, duplex);
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    stats.wire = wire;
+
+    for (int fd : fds) {
+        close(fd);
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief  接收文件或目录
+ *  从第 0 条连接收到清单后打开目标文件（不截断），并行计算已有内容的块摘要，
+ * 与清单比较后把需要发送的块做成位图回复给发送方。然后把文件设置成清单中的
+ * 大小，每条连接由一个工作线程接收块，压缩过的块先解压，再用 pwrite 写到对应偏移。
+ * @param streams  已经建立的连接
+ * @param target  根据清单中的文件返回本地的目标路径
+ * @param stats  返回传输统计
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int receiveFiles(std::vector<Stream>& streams,
+                 const std::function<std::string(const FileEntry&)>& target,
+                 TransferStats& stats) {
+    Stream& control = streams[0];
+    std::vector<char> message;
+    std::vector<FileEntry> files;
+    uint32_t features;
+    if (rudp_recv_message(control.sockfd, message, control.addr,
+                          control.expected_seq) < 0 ||
+        !decodeManifest(message, files, features)) {
+        LOG(ERROR) << "Invalid manifest";
+        return -1;
+    }
+    // 目前支持的特性只有压缩，同意发送方提出的全部特性
+    features &= FEATURE_COMPRESS;
+    LOG(INFO) << "Received manifest with " << files.size() << " files";
+
+    std::vector<int> fds;
+    for (const auto& file : files) {
+        std::filesystem::path path = target(file);
+        std::error_code ec;
+        if (path.has_parent_path()) {
+            std::filesystem::create_directories(path.parent_path(), ec);
+        }
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            LOG(ERROR) << "Failed to create output file " << path;
+        }
+        fds.push_back(fd);
+    }
+
+    // 对比已有内容，只请求缺失或者内容不同的块
+    std::vector<ChunkTask> tasks = splitChunks(files);
+    std::vector<std::optional<uint64_t>> local = hashChunks(fds, tasks);
+    std::vector<char> reply(sizeof(features) + (tasks.size() + 7) / 8, 0);
+    memcpy(reply.data(), &features, sizeof(features));
+    char* bitmap = reply.data() + sizeof(features);
+    stats = TransferStats();
+    stats.files = files.size();
+    stats.streams = streams.size();
+    for (size_t t = 0; t < tasks.size(); ++t) {
+        const FileEntry& file = files[tasks[t].file_index];
+        size_t index = tasks[t].offset / STRIPE_CHUNK_SIZE;
+        if (local[t] && *local[t] == file.digests[index]) {
+            stats.skipped += tasks[t].length;
+        } else {
+            bitmap[t / 8] |= 1 << (t % 8);
+            stats.bytes += tasks[t].length;
+        }
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (fds[i] >= 0 && ftruncate(fds[i], files[i].size) < 0) {
+            LOG(ERROR) << "Failed to resize output file " << files[i].path;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    rudp_send_message(control.sockfd, reply, control.addr, control.seq_num,
+                      deliveryDuplex(control.expected_seq));
+    LOG(INFO) << "Requested " << stats.bytes << " bytes, "
+              << stats.skipped << " bytes already present";
+
+    std::atomic<uint64_t> wire{0};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        workers.emplace_back([&, i] {
+            Stream& stream = streams[i];
+            std::vector<char> chunk;
+            std::vector<uint8_t> raw;
+            while (true) {
+                ssize_t n = rudp_recv_message(
+                    stream.sockfd, chunk, stream.addr, stream.expected_seq,
+                    sizeof(ChunkHeader) + STRIPE_CHUNK_SIZE);
+                ChunkHeader header;
+                if (n < 0) {
+                    // 消息放不下、解压失败，或者连接已经关闭（共享内存连接收到
+                    // FIN、对端进程退出后每次都立即返回 -1），放弃这条连接
+                    LOG(ERROR) << "Failed to receive chunk on stream " << i;
+                    failed = true;
+                    break;
+                } else if (n < static_cast<ssize_t>(sizeof(header))) {
+                    LOG(ERROR) << "Malformed chunk on stream " << i;
+                    failed = true;
+                    continue;
+                }
+                memcpy(&header, chunk.data(), sizeof(header));
+                if (header.file_index == CHUNK_END) {
+                    break;
+                }
+                size_t length = n - sizeof(header);
+                const char* data = chunk.data() + sizeof(header);
+                wire += length;
+                if (header.file_index >= files.size() ||
+                    header.offset >= files[header.file_index].size) {
+                    LOG(ERROR) << "Invalid chunk on stream " << i;
+                    failed = true;
+                    continue;
+                }
+                if (header.flags & CHUNK_COMPRESSED) {
+                    // 解压后的长度必须正好是这个块的长度
+                    uint64_t remaining =
+                        files[header.file_index].size - header.offset;
+                    size_t expected = remaining < STRIPE_CHUNK_SIZE
+                                          ? remaining
+                                          : STRIPE_CHUNK_SIZE;
+                    raw.resize(expected);
+                    if (!(features & FEATURE_COMPRESS) ||
+                        lzDecompress(reinterpret_cast<const uint8_t*>(data),
+                                     length, raw.data(), expected) !=
+                            static_cast<ssize_t>(expected)) {
+                        LOG(ERROR) << "Corrupt compressed chunk on stream " << i;
+                        failed = true;
+                        continue;
+                    }
+                    data = reinterpret_cast<const char*>(raw.data());
+                    length = expected;
+                }
+                if (header.offset + length > files[header.file_index].size ||
+                    fds[header.file_index] < 0 ||
+                    pwrite(fds[header.file_index], data, length,
+                           header.offset) != static_cast<ssize_t>(length)) {
+                    LOG(ERROR) << "Failed to write chunk on stream " << i;
+                    failed = true;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    stats.seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    stats.wire = wire;
+
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief  关闭已经建立的连接和它们的 socket
+ * @param conns  连接
+ * @param client  是否由本端发起关闭
+ */
+void closeStreams(std::vector<Stream>& conns, bool client) {
+    for (auto& conn : conns) {
+        if (client) {
+            rudp_close_connection(conn.sockfd, conn.addr);
+        } else {
+            rudp_wait_close(conn.sockfd, conn.addr);
+        }
+        close(conn.sockfd);
+    }
+    conns.clear();
+}
+
+/**
+ * @brief  建立一条到 port + index 的连接
+ * @param server_addr  服务器地址
+ * @param index  连接的编号
+ * @param conn  返回建立的连接
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int connectStream(const sockaddr_in& server_addr, int index, Stream& conn) {
+    conn.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (conn.sockfd < 0) {
+        LOG(ERROR) << "Socket creation failed";
+        return -1;
+    }
+    conn.addr = server_addr;
+    conn.addr.sin_port = htons(ntohs(server_addr.sin_port) + index);
+    if (rudp_connect(conn.sockfd, conn.addr) < 0) {
+        LOG(ERROR) << "Failed to connect stream " << index;
+        close(conn.sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief  并行发送文件或目录
+ *  先建立第 0 条连接，在上面发送本端的连接数，服务端回复双方都能提供的
+ * 连接数（两端连接数的较小值），再建立其余的连接，用 sendFiles 发送后关闭连接。
+ * @param server_addr  服务器地址，第 i 条连接使用端口 port + i
+ * @param streams  希望使用的连接数
+ * @param path  要发送的文件或目录
+ * @param stats  返回传输统计
+ * @param compress  是否提出压缩
+ * @param pace  是否按节奏发送块数据
+ * @param txtime  按节奏发送时是否使用 SO_TXTIME
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int sendStriped(const sockaddr_in& server_addr, int streams,
+                const std::string& path, TransferStats& stats,
+                bool compress = false, bool pace = false, bool txtime = false) {
+    std::vector<Stream> conns(1);
+    if (connectStream(server_addr, 0, conns[0]) < 0) {
+        return -1;
+    }
+
+    uint32_t count = streams;
+    Stream& control = conns[0];
+    rudp_send_message(control.sockfd,
+                      std::span<const char>(
+                          reinterpret_cast<const char*>(&count), sizeof(count)),
+                      control.addr, control.seq_num,
+                      deliveryDuplex(control.expected_seq));
+    if (rudp_recv_message(control.sockfd,
+                          std::span<char>(reinterpret_cast<char*>(&count),
+                                          sizeof(count)),
+                          control.addr, control.expected_seq) !=
+            sizeof(count) ||
+        count == 0 || count > static_cast<uint32_t>(streams)) {
+        LOG(ERROR) << "Invalid stream count from server";
+        closeStreams(conns, true);
+        return -1;
+    }
+    if (count < static_cast<uint32_t>(streams)) {
+        LOG(WARNING) << "Server accepts only " << count << " of " << streams
+                     << " streams";
+    }
+
+    for (uint32_t i = 1; i < count; ++i) {
+        Stream conn;
+        if (connectStream(server_addr, i, conn) < 0) {
+            closeStreams(conns, true);
+            return -1;
+        }
+        conns.push_back(conn);
+    }
+
+    int ret = sendFiles(conns, path, stats, compress, pace, txtime);
+    closeStreams(conns, true);
+    return ret;
+}
+
+/**
+ * @brief  并行接收文件或目录
+ *  在 port .. port + streams - 1 上各绑定一个 socket。先在第 0 个 socket 上
+ * 接受连接，收到客户端的连接数后回复两端连接数的较小值，再依次接受其余的
+ * 连接，多出来的 socket 直接关闭。之后用 receiveFiles 按清单中的相对路径
+ * 写入输出目录。
+ * @param port  起始端口
+ * @param streams  最多接受的连接数
+ * @param outdir  输出目录
+ * @param stats  返回传输统计
+ * @return int  返回 0 表示成功，-1 表示失败
+ */
+int receiveStriped(int port, int streams, const std::string& outdir,
+                   TransferStats& stats) {
+    std::vector<Stream> conns(streams);
+    for (int i = 0; i < streams; ++i) {
+        conns[i].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port + i);
+        if (conns[i].sockfd < 0 ||
+            bind(conns[i].sockfd, (const struct sockaddr*)&server_addr,
+                 sizeof(server_addr)) < 0) {
+            LOG(ERROR) << "Bind failed on port " << port + i;
+            for (int j = 0; j <= i; ++j) {
+                if (conns[j].sockfd >= 0) {
+                    close(conns[j].sockfd);
+                }
+            }
+            return -1;
+        }
+    }
+    LOG(INFO) << "Server listening on ports " << port << "-"
+              << port + streams - 1;
+
+    Stream& control = conns[0];
+    uint32_t count = 0;
+    if (rudp_accept(control.sockfd, control.addr) < 0 ||
+        rudp_recv_message(control.sockfd,
+                          std::span<char>(reinterpret_cast<char*>(&count),
+                                          sizeof(count)),
+                          control.addr, control.expected_seq) !=
+            sizeof(count) ||
+        count == 0) {
+        LOG(ERROR) << "Failed to negotiate stream count";
+        for (auto& conn : conns) {
+            close(conn.sockfd);
+        }
+        return -1;
+    }
+    count = std::min<uint32_t>(count, streams);
+    rudp_send_message(control.sockfd,
+                      std::span<const char>(
+                          reinterpret_cast<const char*>(&count), sizeof(count)),
+                      control.addr, control.seq_num,
+                      deliveryDuplex(control.expected_seq));
+    for (int i = count; i < streams; ++i) {
+        close(conns[i].sockfd);
+    }
+    conns.resize(count);
+    LOG(INFO) << "Using " << count << " streams";
+
+    for (uint32_t i = 1; i < count; ++i) {
+        if (rudp_accept(conns[i].sockfd, conns[i].addr) < 0) {
+            LOG(ERROR) << "Failed to accept stream " << i;
+            for (uint32_t j = i; j < count; ++j) {
+                close(conns[j].sockfd);
+            }
+            conns.resize(i);
+            closeStreams(conns, false);
+            return -1;
+        }
+    }
+
+    int ret = receiveFiles(
+        conns,
+        [&](const FileEntry& file) {
+            return (std::filesystem::path(outdir) / file.path).string();
+        },
+        stats);
+
+    closeStreams(conns, false);
+    if (ret == 0) {
+        LOG(INFO) << "Received " << stats.files << " files into " << outdir;
+    }
+    return ret;
+}
+
+#endif  // TRANSFER_H